@@ -29,17 +29,27 @@
 #include <glib.h>
 #include <glib-object.h>
 #include <glib/gthread.h>
+#include <glib/gstdio.h>
 #include <libxml/uri.h>
-#include <libxml/nanohttp.h>
 #include <libxml/parser.h>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
 #include <location/location-distance-utils.h>
 #include <navigation/navigation-provider.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define NM_PROVIDER_TYPE (nm_provider_get_type ())
@@ -51,10 +61,40 @@ typedef struct _NMProvider NMProvider;
 typedef struct _NMProviderClass NMProviderClass;
 typedef struct _NMProviderPrivate NMProviderPrivate;
 typedef struct _NMProviderCachedTile NMProviderCachedTile;
+typedef struct _NMProviderTileIndexHeader NMProviderTileIndexHeader;
+typedef struct _NMProviderTileRecord NMProviderTileRecord;
+typedef struct _NMProviderSegment NMProviderSegment;
+typedef struct _NMProviderSegmentMap NMProviderSegmentMap;
+typedef struct _NMProviderSegmentRecord NMProviderSegmentRecord;
 typedef struct _NMProviderThreadData NMProviderThreadData;
+typedef struct _NMProviderFetchJob NMProviderFetchJob;
+typedef struct _NMProviderFetchBatch NMProviderFetchBatch;
 typedef struct _GetMapTileParams GetMapTileParams;
+typedef struct _NMProviderMapView NMProviderMapView;
+typedef struct _NMProviderTile NMProviderTile;
+typedef struct _NMProviderMemTile NMProviderMemTile;
 typedef struct _NMProviderLocation NMProviderLocation;
-typedef struct _NMProviderExpiredLocation NMProviderExpiredLocation;
+typedef struct _NMProviderLocationCell NMProviderLocationCell;
+typedef struct _NMProviderLocationCacheHeader NMProviderLocationCacheHeader;
+typedef struct _NMProviderLocationRecord NMProviderLocationRecord;
+typedef struct _NMProviderGeocode NMProviderGeocode;
+typedef struct _NMProviderGeocodeParams NMProviderGeocodeParams;
+typedef struct _NMProviderGeocodeRecord NMProviderGeocodeRecord;
+typedef struct _NMProviderGeocodeCacheHeader NMProviderGeocodeCacheHeader;
+typedef struct _NMProviderLocationsParams NMProviderLocationsParams;
+typedef struct _NMProviderLocationJob NMProviderLocationJob;
+typedef struct _NMProviderMapTilesParams NMProviderMapTilesParams;
+typedef struct _NMProviderRGB565Header NMProviderRGB565Header;
+typedef struct _NMProviderFlight NMProviderFlight;
+typedef struct _NMProviderFlights NMProviderFlights;
+
+typedef gpointer (*NMProviderFlightCopyFunc)(gpointer data);
+typedef struct _NMHttpHost NMHttpHost;
+typedef struct _NMGeocodeParser NMGeocodeParser;
+typedef struct _NMHttpConnection NMHttpConnection;
+
+typedef gboolean (*NMHttpDataFunc)(const guchar *data, gsize len,
+                                   gpointer user_data);
 
 enum _NMProviderThreadFunc
 {
@@ -64,7 +104,18 @@ enum _NMProviderThreadFunc
   LocationToAddress,
   LocationToAddressVerbose,
   GetMapTile,
-  GetPOICategories
+  GetPOICategories,
+  LocationsToAddresses,
+  LocationsToAddressesVerbose,
+  GetMapTiles
+};
+
+/* per location status in LocationsToAddressesReply */
+enum
+{
+  LOCATION_STATUS_FOUND,
+  LOCATION_STATUS_NOT_FOUND,
+  LOCATION_STATUS_OFFLINE
 };
 
 typedef enum _NMProviderThreadFunc NMProviderThreadFunc;
@@ -78,25 +129,152 @@ struct _NMProvider {
   NMProviderPrivate *priv;
 };
 
+struct _NMProviderFlight
+{
+  gboolean done;
+  int waiters;
+  gpointer result;
+};
+
+struct _NMProviderFlights
+{
+  GHashTable *table;
+  gsize key_size;
+  NMProviderFlightCopyFunc copy;
+  GDestroyNotify free;
+};
+
 struct _NMProviderPrivate {
   const gchar *provider_url;
   DBusConnection *dbus;
   DBusGConnection *system_gdbus;
+  DBusGProxy *mce_request_proxy;
+  DBusGProxy *mce_signal_proxy;
+  gboolean device_mode_known;
+  gint offline;
+  /* in ms */
+  int location_from_map_timeout;
   GThreadPool *thread_pool;
+  GThreadPool *fetch_pool;
+  gint max_threads;
+  gint max_downloads;
+  gint active_threads;
+  guint64 pool_wait_ms;
+  guint pool_wait_count;
+  GMutex *con_ic_mutex;
+  GCond *con_ic_cond;
+  gboolean con_ic_pending;
   ConIcConnection *con_ic_conn;
   ConIcConnectionStatus con_ic_status;
   ConIcConnectionError con_ic_error;
   gboolean con_ic_do_not_connect;
+  /* set on exit, no more connection attempts are made */
+  gboolean con_ic_stopped;
   guint response_id;
+  /* the sender of the method call being dispatched, main loop only */
+  gchar *request_sender;
+  /* send replies to everybody, for clients listening on another connection */
+  gboolean broadcast_replies;
+  /* response object path -> pending NMProviderThreadData */
+  GHashTable *requests;
   gchar *cache_dir;
-  GSList *tile_list;
+  GHashTable *tile_index;
+  GQueue tile_lru;
+  guint64 tile_index_size;
+  gboolean tile_index_loaded;
+  gboolean tile_index_dirty;
+  gint tile_index_saving;
+  gboolean packed_cache;
+  GHashTable *segments;
+  guint next_segment;
+  gboolean tile_store_compact;
+  gboolean tile_store_compact_all;
+  NMProviderSegment *write_segment;
+  int write_fd;
+  gsize write_offset;
+  guint64 cache_max_size;
+  guint cache_max_files;
+  GCond *evict_cond;
+  NMProviderFlights tile_flights;
+  GHashTable *mem_tiles;
+  GQueue mem_tiles_lru;
+  gsize mem_tiles_size;
+  gsize mem_tiles_max_size;
+  guint mem_tiles_hits;
+  guint mem_tiles_misses;
   GHashTable *loc_hash_table;
+  gchar *loc_cache_file;
+  GMappedFile *loc_cache_map;
+  /* cached locations by grid cell, so the tolerance lookups only look at
+     the cells around the point */
+  GHashTable *loc_grid;
+  /* cached locations, the least valuable at the top, to evict from */
+  GPtrArray *loc_heap;
+  gboolean loc_cache_dirty;
+  guint loc_cache_max;
+  /* cache key cell size in metres, 0 for exact keys */
+  gdouble loc_quantum;
+  GHashTable *geocode_cache;
+  GQueue geocode_lru;
+  guint geocode_cache_max;
+  guint geocode_hits;
+  guint geocode_misses;
+  gchar *geocode_cache_file;
+  gboolean geocode_cache_dirty;
+  NMProviderFlights loc_flights;
   int provider_twn;
 };
 
+/* tile in the disk cache */
 struct _NMProviderCachedTile {
-  gchar *filename;
-  int timestamp;
+  guint64 key;
+  time_t timestamp;
+  gsize size;
+  /* where it is in the packed store */
+  guint32 segment;
+  guint32 offset;
+  GList link;
+};
+
+/* on-disk tile cache index */
+struct _NMProviderTileIndexHeader {
+  guint32 magic;
+  guint32 version;
+  guint32 count;
+  guint32 next_segment;
+};
+
+struct _NMProviderTileRecord {
+  guint64 key;
+  gint64 timestamp;
+  guint32 size;
+  guint32 segment;
+  guint32 offset;
+  guint32 reserved;
+};
+
+/* A mapping of a packed store segment, kept alive while tiles are decoded
+   from it, even if the segment is remapped or removed meanwhile */
+struct _NMProviderSegmentMap {
+  GMappedFile *file;
+  gint ref_cnt;
+};
+
+/* packed store data file, tiles are only ever appended to it */
+struct _NMProviderSegment {
+  guint id;
+  gsize size;
+  /* bytes of the tiles still in the index */
+  gsize live;
+  NMProviderSegmentMap *map;
+};
+
+/* precedes every tile in a segment */
+struct _NMProviderSegmentRecord {
+  guint32 magic;
+  guint32 len;
+  guint64 key;
+  gint64 timestamp;
 };
 
 struct _NMProviderThreadData
@@ -104,7 +282,26 @@ struct _NMProviderThreadData
   NMProvider *provider;
   NMProviderThreadFunc func;
   gchar *responce;
+  /* unique name of the client the reply goes to */
+  gchar *sender;
   void *data;
+  GTimeVal queued;
+  /* set by CancelRequest */
+  gint cancelled;
+};
+
+struct _NMProviderFetchJob
+{
+  GFunc func;
+  gpointer data;
+  NMProviderFetchBatch *batch;
+};
+
+struct _NMProviderFetchBatch
+{
+  GMutex *mutex;
+  GCond *cond;
+  int pending;
 };
 
 struct _GetMapTileParams
@@ -117,22 +314,246 @@ struct _GetMapTileParams
   int mapoptions;
 };
 
+/* allocated in one block with the viewports following it */
+struct _NMProviderMapTilesParams
+{
+  guint count;
+  GetMapTileParams *items;
+};
+
+/* precedes the pixels of a MAP_FORMAT_RGB565 image, all in host order */
+struct _NMProviderRGB565Header
+{
+  guint32 magic;
+  guint32 width;
+  guint32 height;
+  guint32 stride;
+};
+
+/* Position of the requested area on the tile grid of the zoom level */
+struct _NMProviderMapView
+{
+  double size;
+  double xia;
+  double yia;
+  double x;
+  double y;
+  int pixleft;
+  int pixtop;
+  int cols;
+  int rows;
+};
+
+struct _NMProviderTile
+{
+  guint64 key;
+  int zoom;
+  int x;
+  int y;
+  int mapoptions;
+  gchar *filename;
+  gchar *url;
+  GdkPixbuf *pixbuf;
+  const gint *cancelled;
+};
+
+/* decoded tile in the memory cache */
+struct _NMProviderMemTile
+{
+  guint64 key;
+  GdkPixbuf *pixbuf;
+  gsize size;
+  time_t timestamp;
+  GList link;
+};
+
 struct _NMProviderLocation
 {
   time_t timestamp;
+  /* last hit, or when it was fetched */
+  time_t last_used;
   guint ref_cnt;
   NavigationAddress *navigation_data;
+  /* in the cache file, until navigation_data is decoded from it */
+  const NMProviderLocationRecord *packed;
+  /* the key in loc_hash_table */
+  NavigationLocation *location;
+  NMProviderLocationCell *cell;
+  /* position in loc_heap */
+  guint heap_index;
 };
 
-struct _NMProviderExpiredLocation
+/* location cache file */
+struct _NMProviderLocationCacheHeader
 {
-  NavigationLocation *location;
+  guint32 magic;
+  guint32 version;
+  guint32 count;
+  guint32 reserved;
+};
+
+/* followed by the address fields present, as NUL terminated strings, padded
+   to 8 bytes */
+struct _NMProviderLocationRecord
+{
+  gdouble latitude;
+  gdouble longitude;
+  gint64 timestamp;
+  guint32 ref_cnt;
+  guint32 len;
+  /* bit mask of the address fields present */
+  guint32 fields;
+  /* 0 in older files */
+  guint32 last_used;
+};
+
+#define LOCATION_CACHE_MAGIC 0x434C4D4E /* "NMLC" */
+#define LOCATION_CACHE_VERSION 1
+#define LOCATION_CACHE_SAVE_INTERVAL 300
+
+/* forward geocoding result, keyed by the normalized address */
+struct _NMProviderGeocode
+{
+  gchar *key;
+  NavigationLocation location;
   time_t timestamp;
-  guint ref_cnt;
+  GList link;
+};
+
+/* AddressToLocations thread data */
+struct _NMProviderGeocodeParams
+{
+  gchar *url;
+  gchar *key;
+  /* looked up when the request came in */
+  gboolean cached;
+  NavigationLocation location;
+};
+
+/* geocode cache file */
+struct _NMProviderGeocodeCacheHeader
+{
+  guint32 magic;
+  guint32 version;
+  guint32 count;
+  guint32 reserved;
 };
 
+/* allocated in one block with the locations following it */
+struct _NMProviderLocationsParams
+{
+  guint count;
+  NavigationLocation *locations;
+};
+
+/* one location of a LocationsToAddresses request, in the fetch pool */
+struct _NMProviderLocationJob
+{
+  const NavigationLocation *location;
+  NavigationAddress *address;
+  const gint *cancelled;
+};
+
+/* in the geocode cache file, followed by the key and padded to 8 bytes */
+struct _NMProviderGeocodeRecord
+{
+  gdouble latitude;
+  gdouble longitude;
+  gint64 timestamp;
+  guint32 key_len;
+  guint32 reserved;
+};
+
+#define GEOCODE_CACHE_MAGIC 0x43474D4E /* "NMGC" */
+#define GEOCODE_CACHE_VERSION 1
+#define GEOCODE_CACHE_TTL (30 * 24 * 60 * 60)
+#define GEOCODE_CACHE_SAVE_INTERVAL 300
+
+/* cached locations in a LOCATION_GRID_CELL sized square */
+struct _NMProviderLocationCell
+{
+  guint64 key;
+  GPtrArray *locations;
+};
+
+/* grow the worker pool when requests wait longer than that in the queue */
+#define THREAD_POOL_GROW_WAIT 250
+/* and shrink it when they get picked up almost immediately */
+#define THREAD_POOL_SHRINK_WAIT 20
+
+struct _NMHttpHost
+{
+  gchar *name;
+  int open;
+  GQueue idle;
+  GCond *cond;
+};
+
+struct _NMHttpConnection
+{
+  NMHttpHost *host;
+  int fd;
+  time_t idle_since;
+  gsize start;
+  gsize end;
+  guchar buf[8192];
+};
+
+/* the geocoder response fields, in NMGeocodeParser fields */
+enum
+{
+  GEOCODE_FIELD_LATITUDE,
+  GEOCODE_FIELD_LONGITUDE,
+  GEOCODE_FIELD_COUNTRY,
+  GEOCODE_FIELD_COUNTRY_CODE,
+  GEOCODE_FIELD_DISTRICT,
+  GEOCODE_FIELD_CITY,
+  GEOCODE_FIELD_POST_CODE,
+  GEOCODE_FIELD_STREET,
+  GEOCODE_FIELD_HOUSE_NUM,
+  GEOCODE_FIELD_COUNT
+};
+
+struct _NMGeocodeParser
+{
+  xmlParserCtxtPtr ctxt;
+  /* of the root element, if it is one we know */
+  const char *ns;
+  const char *target;
+  gboolean in_place;
+  gboolean found;
+  /* the response is not well formed */
+  gboolean error;
+  int depth;
+  int position_depth;
+  int thoroughfare_depth;
+  /* depth of the element whose text goes to fields[field], 0 if none */
+  int capture_depth;
+  int field;
+  GString *text;
+  gchar **fields;
+};
+
+/* "host:port" -> NMHttpHost, protected by the http_hosts lock */
+static GHashTable *http_hosts = NULL;
+
+/* signalled when an in-flight request completes, protected by flights lock */
+static GCond *flight_cond = NULL;
+
+/* in degrees */
+#define LOCATION_GRID_CELL 0.01
+#define LOCATION_GRID_KEY(x, y) (((guint64)(guint32)(y) << 32) | (guint32)(x))
+
+G_LOCK_DEFINE_STATIC(http_hosts);
 G_LOCK_DEFINE_STATIC(hash_table);
-G_LOCK_DEFINE_STATIC(conn_ic);
+G_LOCK_DEFINE_STATIC(geocode);
+G_LOCK_DEFINE_STATIC(flights);
+G_LOCK_DEFINE_STATIC(tile_index);
+/* the packed store segment being written, taken before tile_index */
+G_LOCK_DEFINE_STATIC(tile_store);
+G_LOCK_DEFINE_STATIC(mem_tiles);
+G_LOCK_DEFINE_STATIC(thread_pool_stats);
+G_LOCK_DEFINE_STATIC(requests);
 
 G_DEFINE_TYPE(NMProvider, nm_provider, G_TYPE_OBJECT);
 
@@ -150,6 +571,7 @@ static void nm_provider_init(NMProvider *provider)
 {
   GConfClient *client;
   NMProviderPrivate *priv;
+  gint size;
 
   /* FIXME - isn't provider_url supposed to be g_free()-ed in finalize? */
   client = gconf_client_get_default();
@@ -163,6 +585,88 @@ static void nm_provider_init(NMProvider *provider)
       gconf_client_get_bool(client,
                             "/apps/osso/navigation/nokiamaps_provider/twn",
                             NULL);
+  priv->max_threads =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/max_threads",
+                           NULL);
+  if (priv->max_threads <= 0)
+    priv->max_threads = 4;
+
+  priv->max_downloads =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/max_tile_downloads",
+                           NULL);
+  if (priv->max_downloads <= 0)
+    priv->max_downloads = 4;
+
+  size =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/memory_cache_size",
+                           NULL);
+  /* in KiB */
+  priv->mem_tiles_max_size = (size > 0 ? size : 16384) * 1024;
+
+  size =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/cache_max_size",
+                           NULL);
+  /* in MiB */
+  priv->cache_max_size = (guint64)(size > 0 ? size : 200) * 1024 * 1024;
+
+  size =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/cache_max_files",
+                           NULL);
+  priv->cache_max_files = size > 0 ? size : 20000;
+
+  size =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/location_cache_size",
+                           NULL);
+  priv->loc_cache_max = size > 0 ? size : 1000;
+
+  size =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/location_grid_size",
+                           NULL);
+  priv->loc_quantum = MAX(size, 0);
+
+  size =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/location_from_map_timeout",
+                           NULL);
+  /* in seconds, the user has to pick the location meanwhile */
+  priv->location_from_map_timeout = (size > 0 ? size : 120) * 1000;
+
+  size =
+      gconf_client_get_int(client,
+                           "/apps/osso/navigation/nokiamaps_provider/geocode_cache_size",
+                           NULL);
+  priv->geocode_cache_max = size > 0 ? size : 1000;
+  priv->geocode_cache = g_hash_table_new(g_str_hash, g_str_equal);
+  g_queue_init(&priv->geocode_lru);
+
+  if (gconf_client_get_bool(client,
+                            "/apps/osso/navigation/nokiamaps_provider/persistent_geocode_cache",
+                            NULL))
+  {
+    priv->geocode_cache_file =
+        g_strdup_printf("%s/.nokiamaps_provider_geocodes", g_get_home_dir());
+  }
+
+  /* all tiles in a few big files instead of a file per tile */
+  priv->packed_cache =
+      gconf_client_get_bool(client,
+                            "/apps/osso/navigation/nokiamaps_provider/packed_cache",
+                            NULL);
+  priv->broadcast_replies =
+      gconf_client_get_bool(client,
+                            "/apps/osso/navigation/nokiamaps_provider/broadcast_replies",
+                            NULL);
+  priv->write_fd = -1;
+
+  priv->con_ic_mutex = g_mutex_new();
+  priv->con_ic_cond = g_cond_new();
   if (!priv->provider_url)
   {
     gconf_client_set_string(client,
@@ -175,44 +679,181 @@ static void nm_provider_init(NMProvider *provider)
   g_object_unref(client);
 }
 
+/* Allocates a request with a fresh response path and registers it so it can
+   be cancelled until the worker is done with it */
+static NMProviderThreadData *
+navigation_thread_data_new(NMProvider *provider, NMProviderThreadFunc func,
+                           void *data)
+{
+  NMProviderPrivate *priv = provider->priv;
+  NMProviderThreadData *thread_data;
+
+  thread_data = (NMProviderThreadData *)g_malloc(sizeof(NMProviderThreadData));
+  thread_data->provider = provider;
+  thread_data->func = func;
+  thread_data->data = data;
+  thread_data->cancelled = FALSE;
+  thread_data->sender = g_strdup(priv->request_sender);
+  thread_data->responce = g_strdup_printf("/nokiamaps/response/%u",
+                                          priv->response_id);
+  priv->response_id ++;
+
+  G_LOCK(requests);
+  g_hash_table_insert(priv->requests, thread_data->responce, thread_data);
+  G_UNLOCK(requests);
+
+  return thread_data;
+}
+
+/* dbus-glib doesn't tell synchronous handlers who called them, so the
+   sender is recorded before the call is dispatched */
+static DBusHandlerResult navigation_sender_filter(
+    DBusConnection *connection G_GNUC_UNUSED,
+    DBusMessage *message,
+    NMProviderPrivate *priv)
+{
+  /* the interface is optional in method calls, so don't filter on it */
+  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+  {
+    g_free(priv->request_sender);
+    priv->request_sender = g_strdup(dbus_message_get_sender(message));
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Creates a reply signal on the response path, addressed to the client that
+   made the request unless replies are broadcast */
+static DBusMessage *navigation_reply_new(NMProviderThreadData *thread_data,
+                                         const char *name)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal(thread_data->responce,
+                                    "com.nokia.Navigation.MapProvider", name);
+
+  if (message && thread_data->sender &&
+      !thread_data->provider->priv->broadcast_replies)
+  {
+    dbus_message_set_destination(message, thread_data->sender);
+  }
+
+  return message;
+}
+
+static gboolean navigation_request_cancelled(NMProviderThreadData *thread_data)
+{
+  return g_atomic_int_get(&thread_data->cancelled);
+}
+
 static gboolean navigation_thread_pool_push(NMProviderThreadData *data)
 {
+  g_get_current_time(&data->queued);
   g_thread_pool_push(data->provider->priv->thread_pool, data, NULL);
 
   return FALSE;
 }
 
-static gboolean offline_mode(NMProviderPrivate *priv)
+/* Called every second from the main loop, resizes the worker pool according
+   to how long requests had to wait in the queue since the last call */
+static gboolean navigation_thread_pool_adjust(NMProviderPrivate *priv)
+{
+  gint max_threads = g_thread_pool_get_max_threads(priv->thread_pool);
+  guint unprocessed = g_thread_pool_unprocessed(priv->thread_pool);
+  guint64 avg_wait = 0;
+  guint count;
+
+  G_LOCK(thread_pool_stats);
+  count = priv->pool_wait_count;
+  if (count)
+    avg_wait = priv->pool_wait_ms / count;
+  priv->pool_wait_ms = 0;
+  priv->pool_wait_count = 0;
+  G_UNLOCK(thread_pool_stats);
+
+  /* nothing was picked up for a whole period, yet there is work queued - all
+     the workers are stuck on slow requests */
+  if ((avg_wait > THREAD_POOL_GROW_WAIT || (!count && unprocessed)) &&
+      max_threads < priv->max_threads)
+  {
+    max_threads ++;
+  }
+  else if (avg_wait < THREAD_POOL_SHRINK_WAIT && !unprocessed &&
+           max_threads > 1)
+  {
+    max_threads --;
+  }
+  else
+    return TRUE;
+
+  g_thread_pool_set_max_threads(priv->thread_pool, max_threads, NULL);
+
+  return TRUE;
+}
+
+static gboolean device_mode_offline(const char *device_mode)
+{
+  return !g_strcmp0(device_mode, "flight") || !g_strcmp0(device_mode, "offline");
+}
+
+static void mce_device_mode_ind(DBusGProxy *proxy G_GNUC_UNUSED,
+                                const char *device_mode,
+                                NMProviderPrivate *priv)
+{
+  priv->device_mode_known = TRUE;
+  g_atomic_int_set(&priv->offline, device_mode_offline(device_mode));
+}
+
+static void mce_get_device_mode_reply(DBusGProxy *proxy,
+                                      DBusGProxyCall *call,
+                                      NMProviderPrivate *priv)
 {
-  DBusGProxy *proxy;
-  gboolean rv;
   GError *error = NULL;
   char *device_mode;
 
-  proxy = dbus_g_proxy_new_for_name(priv->system_gdbus,
-                                    "com.nokia.mce",
-                                    "/com/nokia/mce/request",
-                                    "com.nokia.mce.request");
-  dbus_g_proxy_call(proxy, "get_device_mode", &error,
-                    G_TYPE_INVALID,
-                    G_TYPE_STRING, &device_mode,
-                    G_TYPE_INVALID);
-  g_object_unref(proxy);
-
-  if (error)
+  if (!dbus_g_proxy_end_call(proxy, call, &error,
+                             G_TYPE_STRING, &device_mode,
+                             G_TYPE_INVALID))
   {
     g_warning("%s: %s", __func__, error->message);
     g_error_free(error);
-    return FALSE;
+    return;
   }
 
-  if (!g_strcmp0(device_mode, "flight") || !g_strcmp0(device_mode, "offline"))
-    rv = TRUE;
-  else
-    rv = FALSE;
+  /* a mode change signal is more recent than that */
+  if (!priv->device_mode_known)
+    g_atomic_int_set(&priv->offline, device_mode_offline(device_mode));
+
   g_free(device_mode);
+}
 
-  return rv;
+/* The device mode is asked for once and then followed through the MCE
+   signals, so the requests don't have to wait for MCE */
+static void mce_device_mode_init(NMProviderPrivate *priv)
+{
+  priv->mce_signal_proxy =
+      dbus_g_proxy_new_for_name(priv->system_gdbus,
+                                "com.nokia.mce",
+                                "/com/nokia/mce/signal",
+                                "com.nokia.mce.signal");
+  dbus_g_proxy_add_signal(priv->mce_signal_proxy, "sig_device_mode_ind",
+                          G_TYPE_STRING, G_TYPE_INVALID);
+  dbus_g_proxy_connect_signal(priv->mce_signal_proxy, "sig_device_mode_ind",
+                              G_CALLBACK(mce_device_mode_ind), priv, NULL);
+
+  priv->mce_request_proxy =
+      dbus_g_proxy_new_for_name(priv->system_gdbus,
+                                "com.nokia.mce",
+                                "/com/nokia/mce/request",
+                                "com.nokia.mce.request");
+  dbus_g_proxy_begin_call(priv->mce_request_proxy, "get_device_mode",
+                          (DBusGProxyCallNotify)mce_get_device_mode_reply,
+                          priv, NULL, G_TYPE_INVALID);
+}
+
+static gboolean offline_mode(NMProviderPrivate *priv)
+{
+  return g_atomic_int_get(&priv->offline);
 }
 
 static gboolean navigation_location_to_addresses(NMProvider *provider,
@@ -235,14 +876,52 @@ static gboolean navigation_location_to_addresses(NMProvider *provider,
   location = (NavigationLocation *)g_malloc(sizeof(NavigationLocation));
   location->longitude = longitude;
   location->latitude = latitude;
-  thread_data =
-      (NMProviderThreadData *)g_malloc(sizeof(NMProviderThreadData));
-  thread_data->provider = provider;
-  thread_data->data = location;
-  thread_data->func = (verbose ? LocationToAddressVerbose : LocationToAddress);
-  thread_data->responce = g_strdup_printf("/nokiamaps/response/%u",
-                                          provider->priv->response_id);
-  provider->priv->response_id++;
+  thread_data = navigation_thread_data_new(
+        provider, (verbose ? LocationToAddressVerbose : LocationToAddress),
+        location);
+  *objectpath = g_strdup(thread_data->responce);
+  g_idle_add((GSourceFunc)navigation_thread_pool_push, thread_data);
+
+  return TRUE;
+}
+
+static gboolean navigation_locations_to_addresses(NMProvider *provider,
+                                                  GPtrArray *locations,
+                                                  gboolean verbose,
+                                                  gchar **objectpath,
+                                                  GError **error)
+{
+  NMProviderThreadData *thread_data;
+  NMProviderLocationsParams *params;
+  guint i;
+
+  if (!verbose && offline_mode(provider->priv))
+  {
+    g_set_error(error, g_quark_from_static_string("nm-navigation-provider"), 0,
+                "%s not possible in offline mode", __func__);
+    return FALSE;
+  }
+
+  params = (NMProviderLocationsParams *)
+      g_malloc(sizeof(NMProviderLocationsParams) +
+               locations->len * sizeof(NavigationLocation));
+  params->count = locations->len;
+  params->locations = (NavigationLocation *)(params + 1);
+
+  for (i = 0; i < locations->len; i ++)
+  {
+    GValueArray *location = (GValueArray *)g_ptr_array_index(locations, i);
+
+    params->locations[i].latitude =
+        g_value_get_double(g_value_array_get_nth(location, 0));
+    params->locations[i].longitude =
+        g_value_get_double(g_value_array_get_nth(location, 1));
+  }
+
+  thread_data = navigation_thread_data_new(
+        provider,
+        (verbose ? LocationsToAddressesVerbose : LocationsToAddresses),
+        params);
   *objectpath = g_strdup(thread_data->responce);
   g_idle_add((GSourceFunc)navigation_thread_pool_push, thread_data);
 
@@ -348,15 +1027,54 @@ static gboolean navigation_show_places_topos(NMProvider *provider,
   return TRUE;
 }
 
-static gboolean navigation_get_location_from_map(NMProvider *provider,
-                                                 guint mapoption,
-                                                 gchar **objectpath,
-                                                 GError **error)
+static void navigation_get_location_from_map_return_error(
+    DBusGMethodInvocation *context,
+    const char *message)
 {
-  DBusMessage *message;
-  DBusMessage *reply;
+  GError *error = g_error_new_literal(
+        g_quark_from_static_string("nm-navigation-provider"), 0, message);
+
+  dbus_g_method_return_error(context, error);
+  g_error_free(error);
+}
+
+static void navigation_get_location_from_map_reply(
+    DBusPendingCall *pending,
+    DBusGMethodInvocation *context)
+{
+  DBusMessage *reply = dbus_pending_call_steal_reply(pending);
   const char *path;
-  gboolean rv = FALSE;
+
+  if (!reply || dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+  {
+    navigation_get_location_from_map_return_error(
+          context, "Navigation provider could not connect to map application");
+  }
+  else if (dbus_message_get_args(reply, NULL,
+                                 DBUS_TYPE_OBJECT_PATH, &path,
+                                 DBUS_TYPE_INVALID))
+  {
+    dbus_g_method_return(context, path);
+  }
+  else
+  {
+    navigation_get_location_from_map_return_error(
+          context, "Could not parse object path from response");
+  }
+
+  if (reply)
+    dbus_message_unref(reply);
+}
+
+/* The map application might take a while (the user picks the location), so
+   it is asked asynchronously and the return is sent once it answers */
+static gboolean navigation_get_location_from_map(
+    NMProvider *provider,
+    guint mapoption,
+    DBusGMethodInvocation *context)
+{
+  DBusMessage *message;
+  DBusPendingCall *pending = NULL;
 
   message = dbus_message_new_method_call(
               "com.nokia.NokiaMaps",
@@ -365,40 +1083,34 @@ static gboolean navigation_get_location_from_map(NMProvider *provider,
               "GetLocationFromMap");
   if (!message)
   {
-    g_set_error(error, g_quark_from_static_string("nm-navigation-provider"), 0,
-                "Could not create new dbus method call");
-    goto out;
+    navigation_get_location_from_map_return_error(
+          context, "Could not create new dbus method call");
+    return TRUE;
   }
 
   dbus_message_append_args(message,
                            DBUS_TYPE_UINT32, &mapoption,
                            DBUS_TYPE_INVALID);
-  reply = dbus_connection_send_with_reply_and_block(provider->priv->dbus,
-                                                    message, -1, NULL);
-  dbus_message_unref(message);
 
-  if (!reply)
+  if (!dbus_connection_send_with_reply(provider->priv->dbus, message, &pending,
+                                       provider->priv->location_from_map_timeout)
+      || !pending)
   {
-    g_set_error(error, g_quark_from_static_string("nm-navigation-provider"), 0,
-                "Navigation provider could not connect to map application");
-    goto out;
+    navigation_get_location_from_map_return_error(
+          context, "Navigation provider could not connect to map application");
   }
-
-  if (dbus_message_get_args(reply, NULL,
-                             DBUS_TYPE_OBJECT_PATH, &path,
-                             DBUS_TYPE_INVALID))
+  else
   {
-    *objectpath = g_strdup(path);
-    rv = TRUE;
+    dbus_pending_call_set_notify(
+          pending,
+          (DBusPendingCallNotifyFunction)navigation_get_location_from_map_reply,
+          context, NULL);
+    dbus_pending_call_unref(pending);
   }
-  else
-    g_set_error(error, g_quark_from_static_string("nm-navigation-provider"), 0,
-                "Could not parse object path from response");
 
-  dbus_message_unref(reply);
+  dbus_message_unref(message);
 
-out:
-  return rv;
+  return TRUE;
 }
 
 static gboolean navigation_show_route(NMProvider *provider,
@@ -481,16 +1193,9 @@ static gboolean navigation_get_po_icategories(NMProvider *provider,
                                               gchar **objectpath,
                                               GError **error G_GNUC_UNUSED)
 {
-  NMProviderPrivate *priv = provider->priv;
   NMProviderThreadData *thread_data;
 
-  thread_data = (NMProviderThreadData *)g_malloc(sizeof(NMProviderThreadData));
-  thread_data->func = GetPOICategories;
-  thread_data->provider = provider;
-  thread_data->data = NULL;
-  thread_data->responce = g_strdup_printf("/nokiamaps/response/%u",
-                                          priv->response_id);
-  priv->response_id++;
+  thread_data = navigation_thread_data_new(provider, GetPOICategories, NULL);
   *objectpath = g_strdup(thread_data->responce);
   g_idle_add((GSourceFunc)navigation_thread_pool_push, thread_data);
 
@@ -509,7 +1214,6 @@ static gboolean navigation_get_map_tile(NMProvider *provider,
 {
   GetMapTileParams *params;
   NMProviderThreadData *thread_data;
-  NMProviderPrivate *priv;
 
   if (offline_mode(provider->priv))
   {
@@ -533,551 +1237,2167 @@ static gboolean navigation_get_map_tile(NMProvider *provider,
   else
     params->zoom = zoom;
 
-  thread_data = (NMProviderThreadData *)g_malloc(sizeof(NMProviderThreadData));
-  priv = provider->priv;
-  thread_data->func = GetMapTile;
-  thread_data->data = params;
-  thread_data->provider = provider;
-  thread_data->responce = g_strdup_printf("/nokiamaps/response/%u",
-                                          priv->response_id);
-  priv->response_id ++;
+  thread_data = navigation_thread_data_new(provider, GetMapTile, params);
   *objectpath = g_strdup(thread_data->responce);
   g_idle_add((GSourceFunc)navigation_thread_pool_push, thread_data);
 
   return TRUE;
 }
 
-static gboolean navigation_address_to_locations(NMProvider *provider,
-                                                const char **address,
-                                                gboolean verbose,
-                                                const char **objectpath,
-                                                GError **error)
+static gboolean navigation_get_map_tiles(NMProvider *provider,
+                                         GPtrArray *viewports,
+                                         const char **objectpath,
+                                         GError **error)
 {
-  NMProviderPrivate *priv = provider->priv;
+  NMProviderMapTilesParams *params;
   NMProviderThreadData *thread_data;
-  GString *string;
-  const char *names[5] = { "num", "str", "city", "zip", "ctr" };
-  int index[5] = {0, 2, 4, 7, 8};
-  int i;
+  guint i;
 
-  if (offline_mode(provider->priv)) {
+  if (offline_mode(provider->priv))
+  {
     g_set_error(error, g_quark_from_static_string("nm-navigation-provider"), 0,
                 "%s not possible in offline mode", __func__);
     return FALSE;
   }
-  string = g_string_new(provider->priv->provider_url);
-  g_string_append(string,
-                  "/gc/1.0?total=1&token=9b87b24dffafdfcb6dfc66eeba834caa");
 
-  /* FIXME - sizeof(index)/sizeof(index[0]) */
-  for (i = 0; i < 5; i ++)
+  params = (NMProviderMapTilesParams *)
+      g_malloc(sizeof(NMProviderMapTilesParams) +
+               viewports->len * sizeof(GetMapTileParams));
+  params->count = viewports->len;
+  params->items = (GetMapTileParams *)(params + 1);
+
+  for (i = 0; i < viewports->len; i ++)
   {
-    if (address[index[i]])
-    {
-      xmlChar *xmlstr = xmlURIEscapeStr((const xmlChar *)address[index[i]],
-                                        NULL);
-      gchar *str = g_strdup_printf("&%s=%s", names[i], xmlstr);
-      g_string_append(string, str);
-      g_free(str);
-      xmlFree(xmlstr);
-    }
+    GValueArray *viewport = (GValueArray *)g_ptr_array_index(viewports, i);
+    GetMapTileParams *item = &params->items[i];
+
+    item->latitude = g_value_get_double(g_value_array_get_nth(viewport, 0));
+    item->longitude = g_value_get_double(g_value_array_get_nth(viewport, 1));
+    item->zoom = g_value_get_int(g_value_array_get_nth(viewport, 2));
+    item->width = g_value_get_int(g_value_array_get_nth(viewport, 3));
+    item->height = g_value_get_int(g_value_array_get_nth(viewport, 4));
+    item->mapoptions = g_value_get_uint(g_value_array_get_nth(viewport, 5));
+
+    if (item->zoom > 18)
+      item->zoom = 18;
   }
 
-  thread_data = (NMProviderThreadData *)g_malloc(sizeof(NMProviderThreadData));
-  thread_data->provider = provider;
-  thread_data->data = g_string_free(string, 0);
-  thread_data->func =
-      (verbose ? AddressToLocationsVerbose : AddressToLocations);
-
-  thread_data->responce = g_strdup_printf("/nokiamaps/response/%u",
-                                          priv->response_id);
-  priv->response_id ++;
+  thread_data = navigation_thread_data_new(provider, GetMapTiles, params);
   *objectpath = g_strdup(thread_data->responce);
   g_idle_add((GSourceFunc)navigation_thread_pool_push, thread_data);
 
   return TRUE;
 }
 
-static gboolean navigation_location_to_addresses_cached(
-    NMProvider *provider,
-    gdouble latitude,
-    gdouble longitude,
-    gdouble tolerance,
-    GPtrArray **addresses,
-    GError **error G_GNUC_UNUSED)
-{
-  NMProviderLocation *nearest;
-  NavigationAddress *navigation_data = NULL;
-  NavigationLocation location = { latitude, longitude };
+/* the address fields sent to the geocoder and the query parameters for
+   them */
+static const char *address_query_names[] = { "num", "str", "city", "zip", "ctr" };
+static const int address_query_fields[] = { 0, 2, 4, 7, 8 };
 
-  G_LOCK(hash_table);
+/* Normalizes the fields sent to the geocoder, so the same address written
+   slightly differently hits the same cache entry */
+static gchar *geocode_key(const char **address)
+{
+  GString *key = g_string_new(NULL);
+  guint i;
 
-  nearest =
-      (NMProviderLocation *)g_hash_table_lookup(provider->priv->loc_hash_table,
-                                                &location);
-  if (!nearest && tolerance)
+  for (i = 0; i < G_N_ELEMENTS(address_query_fields); i ++)
   {
-    GHashTableIter hash_iter;
-    gpointer tmp_key;
-    gpointer tmp_val;
-    gdouble best_distance = 0;
-
-    tolerance /= 1000.0;
+    const char *field = address[address_query_fields[i]];
+    gchar *normalized;
+    gchar *folded;
+    gsize start;
+    gboolean space = FALSE;
+    const gchar *p;
 
-    g_hash_table_iter_init(&hash_iter, provider->priv->loc_hash_table);
+    if (i)
+      g_string_append_c(key, '\x1f');
 
-    while (g_hash_table_iter_next(&hash_iter, &tmp_key, &tmp_val))
-    {
-      gdouble distance = location_distance_between(
-            latitude, longitude,
-            ((NavigationLocation *)tmp_key)->latitude,
-            ((NavigationLocation *)tmp_key)->longitude);
+    if (!field)
+      continue;
 
-      if (distance > tolerance)
-        continue;
+    normalized = g_utf8_normalize(field, -1, G_NORMALIZE_ALL);
+    folded = g_utf8_casefold(normalized ? normalized : field, -1);
+    start = key->len;
 
-      if (best_distance == 0 || distance < best_distance)
+    /* runs of spaces and commas are a single space */
+    for (p = folded; *p; p ++)
+    {
+      if (g_ascii_isspace(*p) || *p == ',')
+        space = TRUE;
+      else
       {
-        best_distance = distance;
-        nearest = tmp_val;
+        if (space && key->len > start)
+          g_string_append_c(key, ' ');
+
+        g_string_append_c(key, *p);
+        space = FALSE;
       }
     }
-  }
-
-  if (nearest)
-  {
-    navigation_data = navigation_address_copy(nearest->navigation_data);
-    nearest->ref_cnt ++;
-  }
-
-  G_UNLOCK(hash_table);
-
-  if (navigation_data)
-  {
-    *addresses = g_ptr_array_new();
-    g_ptr_array_add(*addresses, address_to_array(navigation_data));
-    navigation_address_free(navigation_data);
 
-    return TRUE;
+    g_free(folded);
+    g_free(normalized);
   }
 
-  return FALSE;
+  return g_string_free(key, FALSE);
 }
 
-#include "dbus_glib_marshal_navigation.h"
-
-static void nm_provider_class_init(NMProviderClass *klass)
+static void geocode_params_free(NMProviderGeocodeParams *params)
 {
-  klass->parent_class.finalize = nm_provider_class_finalize;
-  klass->parent_class.dispose = nm_provider_class_dispose;
+  g_free(params->url);
+  g_free(params->key);
+  g_free(params);
+}
 
-  dbus_g_object_type_install_info(klass->parent_class.g_type_class.g_type,
-                                  &dbus_glib_navigation_object_info);
-  g_type_class_add_private(klass, sizeof(NMProviderPrivate));
+/* must be called with geocode locked */
+static void geocode_cache_remove(NMProviderPrivate *priv,
+                                 NMProviderGeocode *geocode)
+{
+  g_queue_unlink(&priv->geocode_lru, &geocode->link);
+  g_hash_table_remove(priv->geocode_cache, geocode->key);
+  g_free(geocode->key);
+  g_slice_free(NMProviderGeocode, geocode);
+  priv->geocode_cache_dirty = TRUE;
 }
 
-static gint compare_tiles(NMProviderCachedTile *a, NMProviderCachedTile *b)
+static gboolean geocode_cache_lookup(NMProviderPrivate *priv, const gchar *key,
+                                     NavigationLocation *location)
 {
-  if (!a || !b)
-    return 0;
+  NMProviderGeocode *geocode;
+  gboolean rv = FALSE;
+
+  G_LOCK(geocode);
+  geocode = (NMProviderGeocode *)g_hash_table_lookup(priv->geocode_cache, key);
+
+  if (geocode)
+  {
+    if (geocode->timestamp > time(NULL) - GEOCODE_CACHE_TTL)
+    {
+      g_queue_unlink(&priv->geocode_lru, &geocode->link);
+      g_queue_push_head_link(&priv->geocode_lru, &geocode->link);
+      *location = geocode->location;
+      rv = TRUE;
+    }
+    else
+      geocode_cache_remove(priv, geocode);
+  }
+
+  G_UNLOCK(geocode);
 
-  return b->timestamp - a->timestamp;
+  return rv;
 }
 
-static guint location_hash(NavigationLocation *location)
+static void geocode_cache_insert(NMProviderPrivate *priv, const gchar *key,
+                                 const NavigationLocation *location,
+                                 time_t timestamp)
 {
-  return 0x1F1F1F1F *
-      (((guint)(location->latitude * 10000.0)) ^
-       ((guint)(location->longitude * 10000.0)));
+  NMProviderGeocode *geocode;
+
+  G_LOCK(geocode);
+  geocode = (NMProviderGeocode *)g_hash_table_lookup(priv->geocode_cache, key);
+
+  if (geocode)
+    geocode_cache_remove(priv, geocode);
+
+  geocode = g_slice_new(NMProviderGeocode);
+  geocode->key = g_strdup(key);
+  geocode->location = *location;
+  geocode->timestamp = timestamp;
+  geocode->link.data = geocode;
+  geocode->link.prev = geocode->link.next = NULL;
+  g_hash_table_insert(priv->geocode_cache, geocode->key, geocode);
+  g_queue_push_head_link(&priv->geocode_lru, &geocode->link);
+  priv->geocode_cache_dirty = TRUE;
+
+  while (g_hash_table_size(priv->geocode_cache) > priv->geocode_cache_max)
+  {
+    geocode_cache_remove(
+          priv,
+          (NMProviderGeocode *)g_queue_peek_tail_link(&priv->geocode_lru)->data);
+  }
+
+  G_UNLOCK(geocode);
 }
 
-static gboolean location_equal(NavigationLocation *a, NavigationLocation *b)
+/* Written least recently used first, so loading restores the order */
+static gboolean geocode_cache_save(NMProviderPrivate *priv)
 {
-  if (!a || !b)
+  static const guint8 zero[8] = { 0 };
+  NMProviderGeocodeCacheHeader header;
+  GByteArray *buf;
+  GList *l;
+  gboolean rv;
+
+  if (!priv->geocode_cache_file)
     return FALSE;
 
-  return (a->latitude == b->latitude) &&
-      (a->longitude == b->longitude);
+  buf = g_byte_array_new();
+  header.magic = GEOCODE_CACHE_MAGIC;
+  header.version = GEOCODE_CACHE_VERSION;
+  header.reserved = 0;
+  g_byte_array_append(buf, (const guint8 *)&header, sizeof(header));
+
+  G_LOCK(geocode);
+
+  header.count = g_hash_table_size(priv->geocode_cache);
+
+  for (l = g_queue_peek_tail_link(&priv->geocode_lru); l; l = l->prev)
+  {
+    NMProviderGeocode *geocode = (NMProviderGeocode *)l->data;
+    NMProviderGeocodeRecord record;
+
+    record.latitude = geocode->location.latitude;
+    record.longitude = geocode->location.longitude;
+    record.timestamp = geocode->timestamp;
+    record.key_len = strlen(geocode->key) + 1;
+    record.reserved = 0;
+    g_byte_array_append(buf, (const guint8 *)&record, sizeof(record));
+    g_byte_array_append(buf, (const guint8 *)geocode->key, record.key_len);
+    g_byte_array_append(buf, zero, (8 - buf->len % 8) % 8);
+  }
+
+  priv->geocode_cache_dirty = FALSE;
+  G_UNLOCK(geocode);
+
+  memcpy(buf->data, &header, sizeof(header));
+  rv = g_file_set_contents(priv->geocode_cache_file, (const gchar *)buf->data,
+                           buf->len, NULL);
+  if (!rv)
+    g_warning("Could not save geocode cache to %s", priv->geocode_cache_file);
+
+  g_byte_array_free(buf, TRUE);
+
+  return rv;
 }
 
-static void location_destroy_notify(NMProviderLocation *location)
+/* called periodically from the main loop */
+static gboolean geocode_cache_save_timeout(NMProviderPrivate *priv)
 {
-  navigation_address_free(location->navigation_data);
-  g_free(location);
+  gboolean dirty;
+
+  G_LOCK(geocode);
+  dirty = priv->geocode_cache_dirty;
+  G_UNLOCK(geocode);
+
+  if (dirty)
+    geocode_cache_save(priv);
+
+  return TRUE;
 }
 
-static void navigation_address_to_locations_error_reply(DBusConnection *dbus,
-                                                        const char *path,
-                                                        const char *name)
+static void geocode_cache_load(NMProviderPrivate *priv)
 {
-  DBusMessage *msg;
-  DBusMessageIter iter;
-  const char *err_msg = "User canceled network connection opening";
-  gushort value = 1;
+  const NMProviderGeocodeCacheHeader *header;
+  GMappedFile *mapped;
+  const gchar *contents;
+  gsize offset;
+  gsize len;
+  guint i;
+
+  if (!priv->geocode_cache_file)
+    return;
+
+  mapped = g_mapped_file_new(priv->geocode_cache_file, FALSE, NULL);
+  if (!mapped)
+    return;
 
-  msg = dbus_message_new_signal(path, "com.nokia.Navigation.MapProvider", name);
+  len = g_mapped_file_get_length(mapped);
+  contents = g_mapped_file_get_contents(mapped);
+  header = (const NMProviderGeocodeCacheHeader *)contents;
 
-  if (msg)
+  if (len < sizeof(NMProviderGeocodeCacheHeader) ||
+      header->magic != GEOCODE_CACHE_MAGIC ||
+      header->version != GEOCODE_CACHE_VERSION)
   {
-    dbus_message_iter_init_append(msg, &iter);
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT16, &value);
-    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &err_msg);
-    dbus_connection_send(dbus, msg, NULL);
-    dbus_message_unref(msg);
+    g_warning("Geocode cache %s is invalid, ignoring it",
+              priv->geocode_cache_file);
+    g_mapped_file_free(mapped);
+    return;
   }
-}
 
-static xmlXPathObjectPtr get_path(xmlXPathContext *ctxt, const char *prefix,
-                                  const char *ns_uri, const char *str)
-{
-  xmlXPathObjectPtr path;
-
-  xmlXPathRegisterNs(ctxt, (const xmlChar *)prefix, (const xmlChar *)ns_uri);
+  offset = sizeof(NMProviderGeocodeCacheHeader);
 
-  path = xmlXPathEval((const xmlChar *)str, ctxt);
-  if (path)
+  for (i = 0; i < header->count; i ++)
   {
-    if ( path->nodesetval && path->nodesetval->nodeNr )
-    {
-      if (!path->nodesetval->nodeTab)
-      {
-        xmlXPathFreeObject(path);
-        path = NULL;
-      }
-    }
-    else
+    const NMProviderGeocodeRecord *record =
+        (const NMProviderGeocodeRecord *)(contents + offset);
+    const gchar *key = (const gchar *)(record + 1);
+    NavigationLocation location;
+
+    if (offset + sizeof(NMProviderGeocodeRecord) > len ||
+        !record->key_len ||
+        offset + sizeof(NMProviderGeocodeRecord) + record->key_len > len ||
+        key[record->key_len - 1])
     {
-      xmlXPathFreeObject(path);
-      path = NULL;
+      g_warning("Geocode cache %s is truncated", priv->geocode_cache_file);
+      break;
     }
-  }
 
-  return path;
-}
+    offset += (sizeof(NMProviderGeocodeRecord) + record->key_len + 7) & ~7;
 
-static char *get_path_text(const char *path, xmlXPathContext *ctxt)
-{
-  xmlXPathObjectPtr obj;
-  char *text = NULL;
+    if (record->timestamp <= time(NULL) - GEOCODE_CACHE_TTL)
+      continue;
 
-  obj = xmlXPathEval((const xmlChar *)path, ctxt);
-  if (obj)
-  {
-    if ( obj->nodesetval && obj->nodesetval->nodeNr && obj->nodesetval->nodeTab)
-      text = (char *)xmlNodeGetContent(*obj->nodesetval->nodeTab);
-    xmlXPathFreeObject(obj);
+    location.latitude = record->latitude;
+    location.longitude = record->longitude;
+    geocode_cache_insert(priv, key, &location, record->timestamp);
   }
 
-  return text;
+  priv->geocode_cache_dirty = FALSE;
+  g_mapped_file_free(mapped);
 }
 
-static xmlDocPtr http_request_reply(const char *url)
+static gboolean navigation_address_to_locations(NMProvider *provider,
+                                                const char **address,
+                                                gboolean verbose,
+                                                const char **objectpath,
+                                                GError **error)
 {
-  xmlBufferPtr xml_buf;
-  void *ctxt;
-  xmlDoc *xml_doc;
-  int len;
-  char *content_type;
-  xmlChar dest[1024];
+  NMProviderPrivate *priv = provider->priv;
+  NMProviderThreadData *thread_data;
+  NMProviderGeocodeParams *params;
+  GString *string;
+  guint i;
 
-  content_type = NULL;
-  xml_buf = xmlBufferCreate();
+  params = (NMProviderGeocodeParams *)g_malloc(sizeof(NMProviderGeocodeParams));
+  params->key = geocode_key(address);
+  /* the worker answers from that, the entry might be evicted meanwhile */
+  params->cached = geocode_cache_lookup(priv, params->key, &params->location);
 
-#pragma message "OVI maps no longer supports \"Referer: Maemo_SW\", please find a replacement or remove that message"
+  G_LOCK(geocode);
+  if (params->cached)
+    priv->geocode_hits ++;
+  else
+    priv->geocode_misses ++;
+  G_UNLOCK(geocode);
 
-  ctxt = xmlNanoHTTPMethod(url, "GET", NULL, &content_type,
-#if 0
-  /* FIXME - that breaks account status location, why? */
-                           "Referer: Maemo_SW\n",
-#else
-                           NULL ,
-#endif
-                           0);
-  if (ctxt && xmlNanoHTTPReturnCode(ctxt) == 200)
+  /* cached results can be sent even when offline */
+  if (offline_mode(provider->priv) && !params->cached) {
+    g_set_error(error, g_quark_from_static_string("nm-navigation-provider"), 0,
+                "%s not possible in offline mode", __func__);
+    geocode_params_free(params);
+    return FALSE;
+  }
+  string = g_string_new(provider->priv->provider_url);
+  g_string_append(string,
+                  "/gc/1.0?total=1&token=9b87b24dffafdfcb6dfc66eeba834caa");
+
+  for (i = 0; i < G_N_ELEMENTS(address_query_fields); i ++)
   {
-    while (1)
+    if (address[address_query_fields[i]])
     {
-      len = xmlNanoHTTPRead(ctxt, dest, sizeof(dest));
-      if (len <= 0)
-        break;
-
-      xmlBufferAdd(xml_buf, dest, len);
+      xmlChar *xmlstr = xmlURIEscapeStr(
+            (const xmlChar *)address[address_query_fields[i]], NULL);
+      gchar *str = g_strdup_printf("&%s=%s", address_query_names[i], xmlstr);
+      g_string_append(string, str);
+      g_free(str);
+      xmlFree(xmlstr);
     }
   }
 
-  xmlNanoHTTPClose(ctxt);
-  g_free(content_type);
-  xml_doc = xmlReadMemory((const char *)xml_buf->content, xml_buf->size, url,
-                          NULL, 0);
-  xmlBufferFree(xml_buf);
+  params->url = g_string_free(string, 0);
+  thread_data = navigation_thread_data_new(
+        provider, (verbose ? AddressToLocationsVerbose : AddressToLocations),
+        params);
+  *objectpath = g_strdup(thread_data->responce);
+  g_idle_add((GSourceFunc)navigation_thread_pool_push, thread_data);
 
-  return xml_doc;
+  return TRUE;
 }
 
-static gboolean can_go_online(NMProviderPrivate *priv, gboolean verbose)
+static gint location_grid_coord(gdouble degrees)
 {
-  /* FIXME simplify and reorder the condition bellow */
-  /* FIXME - isn't there a race condition? i.e. like changing status/error in
-     between g_atomic calls? Maybe a mutex is better/correct thing to use
-  */
-
-  return (!verbose ||
-      g_atomic_int_get(&priv->con_ic_status) != CON_IC_STATUS_DISCONNECTED ||
-      (g_atomic_int_get(&priv->con_ic_error) != CON_IC_CONNECTION_ERROR_USER_CANCELED &&
-      g_atomic_int_get(&priv->con_ic_error)));
+  return (gint)floor(degrees / LOCATION_GRID_CELL);
 }
 
-static void navigation_address_to_locations_reply(NMProviderThreadData *data,
-                                                  gboolean verbose)
+/* Snaps the location to the centre of its loc_quantum sized cell, so fixes
+   a few metres apart share the same cache entry */
+static void location_quantize(NMProviderPrivate *priv,
+                              NavigationLocation *location)
 {
-  DBusMessage *message;
+  /* metres per degree of latitude */
+  gdouble step = priv->loc_quantum / 111320.0;
+  gdouble coslat;
 
-  if (can_go_online(data->provider->priv, verbose)) {
-    message = dbus_message_new_signal(data->responce,
-                                      "com.nokia.Navigation.MapProvider",
-                                      "AddressToLocationsReply");
-    if (message)
-    {
-      DBusMessageIter entry;
-      DBusMessageIter array;
-      xmlDoc *xml_doc;
-
-      dbus_message_iter_init_append(message, &array);
-      dbus_message_iter_open_container(&array, DBUS_TYPE_ARRAY, "(dd)", &entry);
+  if (!priv->loc_quantum)
+    return;
 
-      xml_doc = http_request_reply((const char *)data->data);
-      if (xml_doc)
-      {
-        xmlXPathContext *ctxt = xmlXPathNewContext(xml_doc);
+  location->latitude = (floor(location->latitude / step) + 0.5) * step;
+  coslat = MAX(cos(location->latitude * M_PI / 180.0), 0.01);
+  step /= coslat;
+  location->longitude = (floor(location->longitude / step) + 0.5) * step;
+}
 
-        if (ctxt)
-        {
-          xmlXPathObject *path = get_path(
-                ctxt, "gc",
-                "nokia:geocoder:gc:1.0", "/gc:places/gc:place/gc:location");
-          if (!path)
-            path = get_path(
-                  ctxt, "gc",
-                  "nokia:search:gc:1.0", "/gc:response/gc:place/gc:location");
-          if (path)
-          {
-            char *s;
-            DBusMessageIter loc;
-            NavigationLocation *location =
-                (NavigationLocation *)g_malloc0(sizeof(NavigationLocation));
-
-            s = get_path_text("//gc:position/gc:latitude", ctxt);
-            location->latitude = g_ascii_strtod(s, NULL);
-            g_free(s);
-            s = get_path_text("//gc:position/gc:longitude", ctxt);
-            location->longitude = g_ascii_strtod(s, NULL);
-            g_free(s);
-            dbus_message_iter_open_container(&entry, DBUS_TYPE_STRUCT, NULL,
-                                             &loc);
-            dbus_message_iter_append_basic(&loc,
-                                           DBUS_TYPE_DOUBLE, location);
-            dbus_message_iter_append_basic(&loc,
-                                           DBUS_TYPE_DOUBLE,
-                                           &location->longitude);
-            dbus_message_iter_close_container(&entry, &loc);
-            g_free(location);
-            xmlXPathFreeObject(path);
-            xmlXPathFreeContext(ctxt);
-            xmlFreeDoc(xml_doc);
-          }
-          else
-          {
-            g_warning("Could not parse response");
-            xmlXPathFreeContext(ctxt);
-            xmlFreeDoc(xml_doc);
-          }
-        }
-        else
-        {
-          g_warning("Could not create xpath context");
-          xmlFreeDoc(xml_doc);
-        }
-      }
-      else
-        g_warning("Could not connect to %s", (const char *)data->data);
+/* every hit keeps a location as long in the cache as being used that much
+   later would, up to LOCATION_MAX_CREDIT hits */
+#define LOCATION_HIT_CREDIT (60 * 60)
+#define LOCATION_MAX_CREDIT 24
 
-      dbus_message_iter_close_container(&array, &entry);
-      dbus_connection_send(data->provider->priv->dbus, message, 0);
-      dbus_message_unref(message);
-    }
-  }
-  else
-  {
-    navigation_address_to_locations_error_reply(data->provider->priv->dbus,
-                                                data->responce,
-                                                "AddressToLocationError");
-  }
+static time_t location_rank(NMProviderLocation *location)
+{
+  return location->last_used +
+      MIN(location->ref_cnt, LOCATION_MAX_CREDIT) * LOCATION_HIT_CREDIT;
 }
 
-static int expired_location_compare(NMProviderExpiredLocation *a,
-                                    NMProviderExpiredLocation *b)
+/* The location evicted first. Ranked by both recency and frequency, so
+   locations used a lot once don't stay forever */
+static gboolean location_less(NMProviderLocation *a, NMProviderLocation *b)
 {
-  if (!a || !b)
-    return 0;
-
-  if (a->ref_cnt == b->ref_cnt)
-    return b->timestamp - a->timestamp;
-
-  return b->ref_cnt - a->ref_cnt;
+  return location_rank(a) < location_rank(b);
 }
 
-/* FIXME - looks ugly, ain't :) */
-static void remove_expired(NMProviderPrivate *priv)
+static void location_heap_set(NMProviderPrivate *priv, guint i,
+                              NMProviderLocation *location)
 {
-  GHashTable *hash_table;
+  g_ptr_array_index(priv->loc_heap, i) = location;
+  location->heap_index = i;
+}
 
-  hash_table = priv->loc_hash_table;
+static void location_heap_sift_up(NMProviderPrivate *priv, guint i)
+{
+  NMProviderLocation *location =
+      (NMProviderLocation *)g_ptr_array_index(priv->loc_heap, i);
 
-  if (g_hash_table_size(hash_table) > 120)
+  while (i)
   {
-    GHashTableIter iter;
-    time_t timer;
-    GSList *list = NULL;
-    GSList *nth;
-    GSList *next;
-    NMProviderExpiredLocation *data;
+    guint parent = (i - 1) / 2;
+    NMProviderLocation *p =
+        (NMProviderLocation *)g_ptr_array_index(priv->loc_heap, parent);
 
-    time(&timer);
-    timer -= 30 * 24 * 60 * 60;
-
-    G_LOCK(hash_table);
-    g_hash_table_iter_init(&iter, priv->loc_hash_table);
+    if (!location_less(location, p))
+      break;
 
-    while (1)
-    {
-      gpointer location;
-      gpointer value;
+    location_heap_set(priv, i, p);
+    i = parent;
+  }
 
-      if (!g_hash_table_iter_next(&iter, &location, &value))
-        break;
+  location_heap_set(priv, i, location);
+}
 
-      while (((NMProviderLocation *)value)->timestamp < timer)
-      {
-        g_hash_table_iter_remove(&iter);
+static void location_heap_sift_down(NMProviderPrivate *priv, guint i)
+{
+  NMProviderLocation *location =
+      (NMProviderLocation *)g_ptr_array_index(priv->loc_heap, i);
 
-        if (!g_hash_table_iter_next(&iter, (gpointer *)&location,
-                                    (gpointer *)&value))
-          goto out;
-      }
+  while (1)
+  {
+    guint child = 2 * i + 1;
+    NMProviderLocation *c;
 
-      data = (NMProviderExpiredLocation *)
-          g_malloc0(sizeof(NMProviderExpiredLocation));
-      data->location = location;
-      data->timestamp = ((NMProviderLocation *)value)->timestamp;
-      data->ref_cnt = ((NMProviderLocation *)value)->ref_cnt;
+    if (child >= priv->loc_heap->len)
+      break;
 
-      list = g_slist_insert_sorted(list, data,
-                                   (GCompareFunc)expired_location_compare);
+    if (child + 1 < priv->loc_heap->len &&
+        location_less(g_ptr_array_index(priv->loc_heap, child + 1),
+                      g_ptr_array_index(priv->loc_heap, child)))
+    {
+      child ++;
     }
 
-out:
-    nth = g_slist_nth(list, 79);
-    while (nth)
-    {
-      next = nth->next;
-      if (!next)
-        break;
+    c = (NMProviderLocation *)g_ptr_array_index(priv->loc_heap, child);
 
-      g_hash_table_remove(priv->loc_hash_table,
-                          ((NMProviderExpiredLocation *)next->data)->location);
-      nth = g_slist_delete_link(nth, nth->next);
+    if (!location_less(c, location))
+      break;
 
-      g_free(next->data);
+    location_heap_set(priv, i, c);
+    i = child;
+  }
 
-    }
+  location_heap_set(priv, i, location);
+}
+
+static void location_heap_remove(NMProviderPrivate *priv,
+                                 NMProviderLocation *location)
+{
+  guint i = location->heap_index;
+  NMProviderLocation *last = (NMProviderLocation *)
+      g_ptr_array_remove_index(priv->loc_heap, priv->loc_heap->len - 1);
 
-    G_UNLOCK(hash_table);
-    g_slist_foreach(list, (GFunc)g_free, 0);
-    g_slist_free(list);
+  if (last != location)
+  {
+    location_heap_set(priv, i, last);
+    location_heap_sift_up(priv, i);
+    location_heap_sift_down(priv, last->heap_index);
   }
 }
 
-static void con_ic_status_handler(ConIcConnection *conn G_GNUC_UNUSED,
-                                  ConIcConnectionEvent *event,
-                                  NMProviderPrivate *priv)
+/* Counts a hit, must be called with hash_table locked */
+static void location_cache_touch(NMProviderPrivate *priv,
+                                 NMProviderLocation *location)
 {
-  ConIcConnectionStatus status;
+  location->ref_cnt ++;
+  time(&location->last_used);
+  location_heap_sift_down(priv, location->heap_index);
+}
 
-  status = con_ic_connection_event_get_status(event);
+/* Drops the location from its grid cell, the eviction heap and the cache.
+   Must be called with hash_table locked */
+static void location_cache_remove(NMProviderPrivate *priv,
+                                  NMProviderLocation *location)
+{
+  NMProviderLocationCell *cell = location->cell;
 
-  if (status != (ConIcConnectionStatus)g_atomic_int_get(&priv->con_ic_status))
-    g_atomic_int_set(&priv->con_ic_status, status);
+  location_heap_remove(priv, location);
+  g_ptr_array_remove_fast(cell->locations, location);
 
-  g_atomic_int_set(&priv->con_ic_error, con_ic_connection_event_get_error(event));
+  if (!cell->locations->len)
+  {
+    g_hash_table_remove(priv->loc_grid, &cell->key);
+    g_ptr_array_free(cell->locations, TRUE);
+    g_slice_free(NMProviderLocationCell, cell);
+  }
 
-  G_UNLOCK(conn_ic);
+  g_hash_table_remove(priv->loc_hash_table, location->location);
+  priv->loc_cache_dirty = TRUE;
 }
 
-/* FIXME
-   Now, this is a total mess, not to say that stock code was causing a deadlock
-   I fixed it to work, but it still uses linux-specific GStaticMutex
-   implementation (according to Pali, it is futex that is on the bottom of this)
-   This logic needs a complete re-write - maybe start another thread which does
-   the con_ic_connection_connect call, somehow pass tid to callback(either as
-   userdata or as a global variable), wait until that thread is finished
-   (in con_ic_connect()) and kill that thread from con_ic_status_handler cb,
-   releasing con_ic_connect()
- */
-static void con_ic_connect(NMProviderPrivate *priv)
+/* Returns the cached location, unless it expired, in which case it is
+   dropped. Must be called with hash_table locked */
+static NMProviderLocation *location_cache_lookup(
+    NMProviderPrivate *priv,
+    const NavigationLocation *location)
 {
-  G_LOCK(conn_ic);
+  NMProviderLocation *provider_location = (NMProviderLocation *)
+      g_hash_table_lookup(priv->loc_hash_table, location);
 
-  if (!priv->con_ic_conn)
+  if (provider_location &&
+      provider_location->timestamp < time(NULL) - 30 * 24 * 60 * 60)
   {
-    priv->con_ic_conn = con_ic_connection_new();
-    g_object_set(G_OBJECT(priv->con_ic_conn),
-                 "automatic-connection-events", TRUE, NULL);
-
-    g_signal_connect_data(G_OBJECT(priv->con_ic_conn), "connection-event",
-                                   (GCallback)con_ic_status_handler,
-                                   priv, NULL, 0);
-    con_ic_connection_connect(priv->con_ic_conn, CON_IC_CONNECT_FLAG_NONE);
-    G_LOCK(conn_ic);
+    location_cache_remove(priv, provider_location);
+    provider_location = NULL;
   }
-  else if (g_atomic_int_get(&priv->con_ic_status))
+
+  return provider_location;
+}
+
+/* Evicts the least valuable locations if the cache gets over capacity, must
+   be called with hash_table locked */
+static void location_cache_insert(NMProviderPrivate *priv,
+                                  const NavigationLocation *location,
+                                  NMProviderLocation *provider_location)
+{
+  NMProviderLocationCell *cell;
+  NMProviderLocation *old;
+  guint64 key = LOCATION_GRID_KEY(location_grid_coord(location->longitude),
+                                  location_grid_coord(location->latitude));
+
+  old = (NMProviderLocation *)
+      g_hash_table_lookup(priv->loc_hash_table, location);
+  if (old)
+    location_cache_remove(priv, old);
+
+  cell = (NMProviderLocationCell *)g_hash_table_lookup(priv->loc_grid, &key);
+  if (!cell)
   {
-    con_ic_connection_connect(priv->con_ic_conn, CON_IC_CONNECT_FLAG_NONE);
-    G_LOCK(conn_ic);
+    cell = g_slice_new(NMProviderLocationCell);
+    cell->key = key;
+    cell->locations = g_ptr_array_new();
+    g_hash_table_insert(priv->loc_grid, &cell->key, cell);
   }
 
-  G_UNLOCK(conn_ic);
+  provider_location->location =
+      (NavigationLocation *)g_memdup(location, sizeof(NavigationLocation));
+  provider_location->cell = cell;
+  g_ptr_array_add(cell->locations, provider_location);
+  priv->loc_cache_dirty = TRUE;
 
-  if (g_atomic_int_get(&priv->con_ic_do_not_connect))
-    return;
+  g_hash_table_insert(priv->loc_hash_table, provider_location->location,
+                      provider_location);
 
-  if (g_atomic_int_get(&priv->con_ic_status) == CON_IC_STATUS_DISCONNECTED )
+  g_ptr_array_add(priv->loc_heap, provider_location);
+  location_heap_sift_up(priv, priv->loc_heap->len - 1);
+
+  while (priv->loc_heap->len > priv->loc_cache_max)
   {
-    if (g_atomic_int_get(&priv->con_ic_error) == CON_IC_CONNECTION_ERROR_USER_CANCELED ||
-        g_atomic_int_get(&priv->con_ic_error) == CON_IC_CONNECTION_ERROR_NONE )
-      g_atomic_int_set(&priv->con_ic_do_not_connect, TRUE);
+    location_cache_remove(priv, (NMProviderLocation *)
+                          g_ptr_array_index(priv->loc_heap, 0));
   }
 }
 
-static dbus_bool_t iter_append_safe(DBusMessageIter *iter, char *value)
+static void location_cell_nearest(NMProviderLocationCell *cell,
+                                  gdouble latitude, gdouble longitude,
+                                  gdouble tolerance,
+                                  NMProviderLocation **nearest,
+                                  gdouble *best_distance)
 {
-  const char *s = "";
+  time_t expired = time(NULL) - 30 * 24 * 60 * 60;
+  guint i;
 
-  if (value)
-    return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &value);
+  for (i = 0; i < cell->locations->len; i ++)
+  {
+    NMProviderLocation *location =
+        (NMProviderLocation *)g_ptr_array_index(cell->locations, i);
+    gdouble distance;
 
-  return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &s);
+    /* dropped once looked up exactly */
+    if (location->timestamp < expired)
+      continue;
+
+    distance = location_distance_between(
+          latitude, longitude,
+          location->location->latitude,
+          location->location->longitude);
+
+    if (distance > tolerance)
+      continue;
+
+    if (!*nearest || distance < *best_distance)
+    {
+      *best_distance = distance;
+      *nearest = location;
+    }
+  }
 }
 
-static dbus_bool_t append_dbus_location_data(DBusMessageIter *array,
-                                             NavigationAddress *address)
+/* Returns the closest cached location within tolerance (in km). Must be
+   called with hash_table locked */
+static NMProviderLocation *location_cache_nearest(NMProviderPrivate *priv,
+                                                  gdouble latitude,
+                                                  gdouble longitude,
+                                                  gdouble tolerance)
 {
-  DBusMessageIter elem;
+  NMProviderLocation *nearest = NULL;
+  gdouble best_distance = 0;
+  /* a degree of latitude is never shorter than 110.5 km */
+  gdouble dlat = tolerance / 110.5;
+  gdouble coslat = cos(MIN(fabs(latitude) + dlat, 90.0) * M_PI / 180.0);
+  gdouble dlon = coslat > 0.01 ? dlat / coslat : 360.0;
+  gint x0 = location_grid_coord(longitude - dlon);
+  gint x1 = location_grid_coord(longitude + dlon);
+  gint y0 = location_grid_coord(latitude - dlat);
+  gint y1 = location_grid_coord(latitude + dlat);
+
+  if ((gint64)(x1 - x0 + 1) * (y1 - y0 + 1) >
+      g_hash_table_size(priv->loc_grid) ||
+      longitude - dlon < -180.0 || longitude + dlon > 180.0)
+  {
+    GHashTableIter iter;
+    NMProviderLocationCell *cell;
 
-  dbus_message_iter_open_container(array, DBUS_TYPE_ARRAY,
-                                   DBUS_TYPE_STRING_AS_STRING, &elem);
-  iter_append_safe(&elem, address->house_num);
-  iter_append_safe(&elem, address->house_name);
-  iter_append_safe(&elem, address->street);
+    /* fewer cells in use than in the range, or wrapping around */
+    g_hash_table_iter_init(&iter, priv->loc_grid);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&cell))
+    {
+      location_cell_nearest(cell, latitude, longitude, tolerance,
+                            &nearest, &best_distance);
+    }
+  }
+  else
+  {
+    gint x, y;
+
+    for (y = y0; y <= y1; y ++)
+    {
+      for (x = x0; x <= x1; x ++)
+      {
+        guint64 key = LOCATION_GRID_KEY(x, y);
+        NMProviderLocationCell *cell =
+            (NMProviderLocationCell *)g_hash_table_lookup(priv->loc_grid,
+                                                          &key);
+
+        if (cell)
+        {
+          location_cell_nearest(cell, latitude, longitude, tolerance,
+                                &nearest, &best_distance);
+        }
+      }
+    }
+  }
+
+  return nearest;
+}
+
+/* the NavigationAddress fields, in the order they are stored in the
+   location cache file */
+static const glong address_fields[] = {
+  G_STRUCT_OFFSET(NavigationAddress, house_num),
+  G_STRUCT_OFFSET(NavigationAddress, house_name),
+  G_STRUCT_OFFSET(NavigationAddress, street),
+  G_STRUCT_OFFSET(NavigationAddress, suburb),
+  G_STRUCT_OFFSET(NavigationAddress, town),
+  G_STRUCT_OFFSET(NavigationAddress, municipality),
+  G_STRUCT_OFFSET(NavigationAddress, province),
+  G_STRUCT_OFFSET(NavigationAddress, postal_code),
+  G_STRUCT_OFFSET(NavigationAddress, country),
+  G_STRUCT_OFFSET(NavigationAddress, country_code),
+  G_STRUCT_OFFSET(NavigationAddress, time_zone)
+};
+
+/* Locations loaded from the cache file are only decoded when first used.
+   Returns NULL if the record has more fields than strings. Must be called
+   with hash_table locked */
+static NavigationAddress *location_address(NMProviderLocation *location)
+{
+  if (!location->navigation_data)
+  {
+    const NMProviderLocationRecord *record = location->packed;
+    const gchar *s = (const gchar *)(record + 1);
+    const gchar *end = (const gchar *)record + record->len;
+    NavigationAddress *address =
+        (NavigationAddress *)g_malloc0(sizeof(NavigationAddress));
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(address_fields); i ++)
+    {
+      if (record->fields & (1 << i))
+      {
+        const gchar *nul = s < end ? memchr(s, 0, end - s) : NULL;
+
+        if (!nul)
+        {
+          navigation_address_free(address);
+          return NULL;
+        }
+
+        G_STRUCT_MEMBER(gchar *, address, address_fields[i]) = g_strdup(s);
+        s = nul + 1;
+      }
+    }
+
+    location->navigation_data = address;
+    location->packed = NULL;
+  }
+
+  return location->navigation_data;
+}
+
+static void location_record_append(GByteArray *buf,
+                                   const NavigationLocation *key,
+                                   NMProviderLocation *location)
+{
+  static const guint8 zero[8] = { 0 };
+  NMProviderLocationRecord record;
+  guint start = buf->len;
+
+  memset(&record, 0, sizeof(record));
+
+  if (location->packed)
+  {
+    /* still as loaded, no need to decode it */
+    g_byte_array_append(buf, (const guint8 *)location->packed,
+                        location->packed->len);
+    record.fields = location->packed->fields;
+  }
+  else
+  {
+    NavigationAddress *address = location->navigation_data;
+    guint i;
+
+    g_byte_array_append(buf, (const guint8 *)&record, sizeof(record));
+
+    for (i = 0; i < G_N_ELEMENTS(address_fields); i ++)
+    {
+      const gchar *s = G_STRUCT_MEMBER(gchar *, address, address_fields[i]);
+
+      if (s)
+      {
+        g_byte_array_append(buf, (const guint8 *)s, strlen(s) + 1);
+        record.fields |= 1 << i;
+      }
+    }
+
+    g_byte_array_append(buf, zero, (8 - buf->len % 8) % 8);
+  }
+
+  record.latitude = key->latitude;
+  record.longitude = key->longitude;
+  record.timestamp = location->timestamp;
+  record.ref_cnt = location->ref_cnt;
+  record.last_used = location->last_used;
+  record.len = buf->len - start;
+  memcpy(buf->data + start, &record, sizeof(record));
+}
+
+/* The cache is written to a new file which then replaces the old one, so it
+   is never left half written */
+static gboolean location_cache_save(NMProviderPrivate *priv)
+{
+  NMProviderLocationCacheHeader header;
+  GByteArray *buf = g_byte_array_new();
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+  gboolean rv;
+
+  header.magic = LOCATION_CACHE_MAGIC;
+  header.version = LOCATION_CACHE_VERSION;
+  header.reserved = 0;
+  g_byte_array_append(buf, (const guint8 *)&header, sizeof(header));
+
+  G_LOCK(hash_table);
+
+  header.count = g_hash_table_size(priv->loc_hash_table);
+  g_hash_table_iter_init(&iter, priv->loc_hash_table);
+
+  while (g_hash_table_iter_next(&iter, &key, &value))
+  {
+    location_record_append(buf, (const NavigationLocation *)key,
+                           (NMProviderLocation *)value);
+  }
+
+  priv->loc_cache_dirty = FALSE;
+  G_UNLOCK(hash_table);
+
+  memcpy(buf->data, &header, sizeof(header));
+  rv = g_file_set_contents(priv->loc_cache_file, (const gchar *)buf->data,
+                           buf->len, NULL);
+  if (!rv)
+    g_warning("Could not save location cache to %s", priv->loc_cache_file);
+
+  g_byte_array_free(buf, TRUE);
+
+  return rv;
+}
+
+/* called periodically from the main loop */
+static gboolean location_cache_save_timeout(NMProviderPrivate *priv)
+{
+  gboolean dirty;
+
+  G_LOCK(hash_table);
+  dirty = priv->loc_cache_dirty;
+  G_UNLOCK(hash_table);
+
+  if (dirty)
+    location_cache_save(priv);
+
+  return TRUE;
+}
+
+/* The file is mapped and kept mapped, the addresses are decoded from it on
+   first use only */
+static void location_cache_load(NMProviderPrivate *priv)
+{
+  const NMProviderLocationCacheHeader *header;
+  const gchar *contents;
+  gsize offset;
+  gsize len;
+  time_t timer;
+  guint loaded = 0;
+  guint i;
+
+  priv->loc_cache_map = g_mapped_file_new(priv->loc_cache_file, FALSE, NULL);
+  if (!priv->loc_cache_map)
+    return;
+
+  len = g_mapped_file_get_length(priv->loc_cache_map);
+  contents = g_mapped_file_get_contents(priv->loc_cache_map);
+  header = (const NMProviderLocationCacheHeader *)contents;
+
+  if (len < sizeof(NMProviderLocationCacheHeader) ||
+      header->magic != LOCATION_CACHE_MAGIC ||
+      header->version != LOCATION_CACHE_VERSION)
+  {
+    g_warning("Location cache %s is invalid, ignoring it",
+              priv->loc_cache_file);
+    g_mapped_file_free(priv->loc_cache_map);
+    priv->loc_cache_map = NULL;
+    return;
+  }
+
+  time(&timer);
+  timer -= 30 * 24 * 60 * 60;
+  offset = sizeof(NMProviderLocationCacheHeader);
+
+  G_LOCK(hash_table);
+
+  for (i = 0; i < header->count; i ++)
+  {
+    const NMProviderLocationRecord *record =
+        (const NMProviderLocationRecord *)(contents + offset);
+    NMProviderLocation *location;
+    NavigationLocation key;
+
+    /* the last byte is 0, so the strings can't run past the record */
+    if (offset + sizeof(NMProviderLocationRecord) > len ||
+        record->len < sizeof(NMProviderLocationRecord) ||
+        offset + record->len > len ||
+        contents[offset + record->len - 1])
+    {
+      g_warning("Location cache %s is truncated", priv->loc_cache_file);
+      break;
+    }
+
+    offset += record->len;
+
+    if (record->timestamp < timer)
+      continue;
+
+    location = (NMProviderLocation *)g_malloc0(sizeof(NMProviderLocation));
+    location->timestamp = record->timestamp;
+    location->ref_cnt = record->ref_cnt;
+    location->last_used =
+        record->last_used ? (time_t)record->last_used : location->timestamp;
+    location->packed = record;
+    key.latitude = record->latitude;
+    key.longitude = record->longitude;
+    /* the grid size might have changed meanwhile */
+    location_quantize(priv, &key);
+    location_cache_insert(priv, &key, location);
+    loaded ++;
+  }
+
+  priv->loc_cache_dirty = FALSE;
+  G_UNLOCK(hash_table);
+
+  /* nothing points into it */
+  if (!loaded)
+  {
+    g_mapped_file_free(priv->loc_cache_map);
+    priv->loc_cache_map = NULL;
+  }
+}
+
+static gboolean navigation_location_to_addresses_cached(
+    NMProvider *provider,
+    gdouble latitude,
+    gdouble longitude,
+    gdouble tolerance,
+    GPtrArray **addresses,
+    GError **error G_GNUC_UNUSED)
+{
+  NMProviderLocation *nearest;
+  NavigationAddress *navigation_data = NULL;
+  NavigationLocation location = { latitude, longitude };
+
+  G_LOCK(hash_table);
+
+  location_quantize(provider->priv, &location);
+  nearest = location_cache_lookup(provider->priv, &location);
+  if (!nearest && tolerance)
+    nearest = location_cache_nearest(provider->priv, latitude, longitude,
+                                     tolerance / 1000.0);
+
+  if (nearest && location_address(nearest))
+  {
+    navigation_data = navigation_address_copy(location_address(nearest));
+    location_cache_touch(provider->priv, nearest);
+  }
+
+  G_UNLOCK(hash_table);
+
+  if (navigation_data)
+  {
+    *addresses = g_ptr_array_new();
+    g_ptr_array_add(*addresses, address_to_array(navigation_data));
+    navigation_address_free(navigation_data);
+
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Marks a pending request as cancelled. Queued requests are dropped, map
+   tiles stop being downloaded for the ones already running. No reply signal
+   is sent for a cancelled request. Only the client which made the request
+   may cancel it, so it is asynchronous to find out who is asking. */
+static gboolean navigation_cancel_request(NMProvider *provider,
+                                          const char *objectpath,
+                                          DBusGMethodInvocation *context)
+{
+  NMProviderThreadData *thread_data;
+  gchar *sender = dbus_g_method_get_sender(context);
+  gboolean cancelled = FALSE;
+  gboolean allowed = TRUE;
+
+  G_LOCK(requests);
+  thread_data = (NMProviderThreadData *)
+      g_hash_table_lookup(provider->priv->requests, objectpath);
+
+  if (thread_data)
+  {
+    if (thread_data->sender && g_strcmp0(thread_data->sender, sender))
+      allowed = FALSE;
+    else
+    {
+      g_atomic_int_set(&thread_data->cancelled, TRUE);
+      cancelled = TRUE;
+    }
+  }
+
+  G_UNLOCK(requests);
+  g_free(sender);
+
+  if (allowed)
+    dbus_g_method_return(context, cancelled);
+  else
+  {
+    GError *error = g_error_new_literal(
+          g_quark_from_static_string("nm-navigation-provider"), 0,
+          "The request was made by another client");
+
+    dbus_g_method_return_error(context, error);
+    g_error_free(error);
+  }
+
+  return TRUE;
+}
+
+static gboolean navigation_get_statistics(NMProvider *provider,
+                                          GHashTable **statistics,
+                                          GError **error G_GNUC_UNUSED)
+{
+  NMProviderPrivate *priv = provider->priv;
+
+  *statistics = g_hash_table_new(g_str_hash, g_str_equal);
+
+  G_LOCK(mem_tiles);
+  g_hash_table_insert(*statistics, "memory_cache_hits",
+                      GUINT_TO_POINTER(priv->mem_tiles_hits));
+  g_hash_table_insert(*statistics, "memory_cache_misses",
+                      GUINT_TO_POINTER(priv->mem_tiles_misses));
+  g_hash_table_insert(*statistics, "memory_cache_tiles",
+                      GUINT_TO_POINTER(g_hash_table_size(priv->mem_tiles)));
+  g_hash_table_insert(*statistics, "memory_cache_size",
+                      GUINT_TO_POINTER(priv->mem_tiles_size));
+  G_UNLOCK(mem_tiles);
+
+  G_LOCK(tile_index);
+  g_hash_table_insert(*statistics, "disk_cache_tiles",
+                      GUINT_TO_POINTER(g_hash_table_size(priv->tile_index)));
+  /* in KiB, it won't fit otherwise */
+  g_hash_table_insert(*statistics, "disk_cache_size",
+                      GUINT_TO_POINTER(priv->tile_index_size / 1024));
+  G_UNLOCK(tile_index);
+
+  G_LOCK(geocode);
+  g_hash_table_insert(*statistics, "geocode_cache_hits",
+                      GUINT_TO_POINTER(priv->geocode_hits));
+  g_hash_table_insert(*statistics, "geocode_cache_misses",
+                      GUINT_TO_POINTER(priv->geocode_misses));
+  g_hash_table_insert(*statistics, "geocode_cache_entries",
+                      GUINT_TO_POINTER(g_hash_table_size(priv->geocode_cache)));
+  G_UNLOCK(geocode);
+
+  return TRUE;
+}
+
+#include "dbus_glib_marshal_navigation.h"
+
+static void nm_provider_class_init(NMProviderClass *klass)
+{
+  klass->parent_class.finalize = nm_provider_class_finalize;
+  klass->parent_class.dispose = nm_provider_class_dispose;
+
+  dbus_g_object_type_install_info(klass->parent_class.g_type_class.g_type,
+                                  &dbus_glib_navigation_object_info);
+  g_type_class_add_private(klass, sizeof(NMProviderPrivate));
+}
+
+/* most recent first */
+static gint compare_tiles(NMProviderTileRecord *a, NMProviderTileRecord *b)
+{
+  return (b->timestamp > a->timestamp) - (b->timestamp < a->timestamp);
+}
+
+static guint location_hash(NavigationLocation *location)
+{
+  return 0x1F1F1F1F *
+      (((guint)(location->latitude * 10000.0)) ^
+       ((guint)(location->longitude * 10000.0)));
+}
+
+static gboolean location_equal(NavigationLocation *a, NavigationLocation *b)
+{
+  if (!a || !b)
+    return FALSE;
+
+  return (a->latitude == b->latitude) &&
+      (a->longitude == b->longitude);
+}
+
+/* In-flight request coalescing: the first caller to ask for a key does the
+   work, the ones coming while it is still in progress wait for it and get a
+   copy of its result. */
+static void navigation_flights_init(NMProviderFlights *flights,
+                                    GHashFunc hash_func,
+                                    GEqualFunc key_equal_func,
+                                    gsize key_size,
+                                    NMProviderFlightCopyFunc copy_func,
+                                    GDestroyNotify free_func)
+{
+  flights->table = g_hash_table_new_full(hash_func, key_equal_func, g_free,
+                                         NULL);
+  flights->key_size = key_size;
+  flights->copy = copy_func;
+  flights->free = free_func;
+}
+
+static void navigation_flight_free(NMProviderFlights *flights,
+                                   NMProviderFlight *flight)
+{
+  if (flight->result)
+    flights->free(flight->result);
+
+  g_slice_free(NMProviderFlight, flight);
+}
+
+/* Returns TRUE if the caller is the first one to ask for key and must call
+   navigation_flight_end() once done. Otherwise waits for the one in progress
+   and returns its result (or NULL if it failed) in result. */
+static gboolean navigation_flight_begin(NMProviderFlights *flights,
+                                        gconstpointer key, gpointer *result)
+{
+  NMProviderFlight *flight;
+
+  G_LOCK(flights);
+  flight = (NMProviderFlight *)g_hash_table_lookup(flights->table, key);
+
+  if (!flight)
+  {
+    flight = g_slice_new0(NMProviderFlight);
+    g_hash_table_insert(flights->table, g_memdup(key, flights->key_size),
+                        flight);
+    G_UNLOCK(flights);
+
+    return TRUE;
+  }
+
+  flight->waiters ++;
+
+  while (!flight->done)
+    g_cond_wait(flight_cond, g_static_mutex_get_mutex(&G_LOCK_NAME(flights)));
+
+  *result = flight->result ? flights->copy(flight->result) : NULL;
+
+  if (!--flight->waiters)
+    navigation_flight_free(flights, flight);
+
+  G_UNLOCK(flights);
+
+  return FALSE;
+}
+
+/* result is not consumed, the waiters get copies of it */
+static void navigation_flight_end(NMProviderFlights *flights,
+                                  gconstpointer key, gpointer result)
+{
+  NMProviderFlight *flight;
+
+  G_LOCK(flights);
+  flight = (NMProviderFlight *)g_hash_table_lookup(flights->table, key);
+  g_hash_table_remove(flights->table, key);
+
+  if (flight->waiters)
+  {
+    flight->result = result ? flights->copy(result) : NULL;
+    flight->done = TRUE;
+    g_cond_broadcast(flight_cond);
+  }
+  else
+    navigation_flight_free(flights, flight);
+
+  G_UNLOCK(flights);
+}
+
+static guint tile_key_hash(const guint64 *key)
+{
+  return (guint)(*key ^ (*key >> 32)) * 0x9E3779B1;
+}
+
+static gboolean tile_key_equal(const guint64 *a, const guint64 *b)
+{
+  return *a == *b;
+}
+
+/* location_cache_remove() drops it from the grid and the heap first */
+static void location_destroy_notify(NMProviderLocation *location)
+{
+  /* not decoded from the cache file yet */
+  if (location->navigation_data)
+    navigation_address_free(location->navigation_data);
+  g_free(location);
+}
+
+static void navigation_address_to_locations_error_reply(
+    NMProviderThreadData *thread_data,
+    const char *name)
+{
+  DBusMessage *msg;
+  DBusMessageIter iter;
+  const char *err_msg = "User canceled network connection opening";
+  gushort value = 1;
+
+  msg = navigation_reply_new(thread_data, name);
+
+  if (msg)
+  {
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT16, &value);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &err_msg);
+    dbus_connection_send(thread_data->provider->priv->dbus, msg, NULL);
+    dbus_message_unref(msg);
+  }
+}
+
+/* Minimal HTTP/1.1 client which keeps connections alive between requests.
+   Idle connections are kept per host (at most HTTP_MAX_CONNECTIONS open to a
+   host at any time) and closed after HTTP_IDLE_TIMEOUT seconds. */
+
+#define HTTP_MAX_CONNECTIONS 4
+#define HTTP_IDLE_TIMEOUT 10
+#define HTTP_IO_TIMEOUT 60
+/* a server sending more than that is broken or hostile, the connection is
+   dropped */
+#define HTTP_MAX_LINE 8192
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_BODY (4 * 1024 * 1024)
+
+static NMHttpHost *http_host_get(const gchar *host_port)
+{
+  NMHttpHost *host;
+
+  if (!http_hosts)
+    http_hosts = g_hash_table_new(g_str_hash, g_str_equal);
+
+  host = (NMHttpHost *)g_hash_table_lookup(http_hosts, host_port);
+  if (!host)
+  {
+    host = g_new0(NMHttpHost, 1);
+    host->name = g_strdup(host_port);
+    host->cond = g_cond_new();
+    g_queue_init(&host->idle);
+    g_hash_table_insert(http_hosts, host->name, host);
+  }
+
+  return host;
+}
+
+static void http_connection_free(NMHttpConnection *conn)
+{
+  if (conn->fd >= 0)
+    close(conn->fd);
+
+  g_free(conn);
+}
+
+static int http_connect(const gchar *hostname, const gchar *port)
+{
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+  struct timeval tv = { HTTP_IO_TIMEOUT, 0 };
+  int fd = -1;
+  int one = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(hostname, port, &hints, &res))
+  {
+    g_warning("Could not resolve %s", hostname);
+    return -1;
+  }
+
+  for (ai = res; ai; ai = ai->ai_next)
+  {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+      break;
+
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(res);
+
+  return fd;
+}
+
+/* Returns an idle connection to host_port or opens a new one, waits if there
+   are too many connections to that host already */
+static NMHttpConnection *http_connection_acquire(const gchar *host_port,
+                                                 gboolean *reused)
+{
+  NMHttpHost *host;
+  NMHttpConnection *conn = NULL;
+  gchar *hostname;
+  const gchar *port;
+  time_t now;
+
+  G_LOCK(http_hosts);
+  host = http_host_get(host_port);
+
+  while (!conn)
+  {
+    time(&now);
+
+    while (!g_queue_is_empty(&host->idle))
+    {
+      conn = (NMHttpConnection *)g_queue_pop_head(&host->idle);
+
+      if (now - conn->idle_since < HTTP_IDLE_TIMEOUT)
+        break;
+
+      host->open --;
+      http_connection_free(conn);
+      conn = NULL;
+    }
+
+    if (conn)
+    {
+      *reused = TRUE;
+      break;
+    }
+
+    if (host->open < HTTP_MAX_CONNECTIONS)
+    {
+      host->open ++;
+      break;
+    }
+
+    g_cond_wait(host->cond, g_static_mutex_get_mutex(&G_LOCK_NAME(http_hosts)));
+  }
+
+  G_UNLOCK(http_hosts);
+
+  if (conn)
+    return conn;
+
+  *reused = FALSE;
+
+  port = strrchr(host_port, ':');
+  hostname = g_strndup(host_port, port - host_port);
+  conn = g_new0(NMHttpConnection, 1);
+  conn->host = host;
+  conn->fd = http_connect(hostname, port + 1);
+  g_free(hostname);
+
+  if (conn->fd < 0)
+  {
+    G_LOCK(http_hosts);
+    host->open --;
+    g_cond_signal(host->cond);
+    G_UNLOCK(http_hosts);
+    g_free(conn);
+
+    return NULL;
+  }
+
+  return conn;
+}
+
+/* Puts the connection back to the idle list if it can be reused or closes
+   it otherwise */
+static void http_connection_release(NMHttpConnection *conn, gboolean reusable)
+{
+  NMHttpHost *host = conn->host;
+
+  G_LOCK(http_hosts);
+
+  if (reusable)
+  {
+    time(&conn->idle_since);
+    g_queue_push_head(&host->idle, conn);
+  }
+  else
+  {
+    host->open --;
+    http_connection_free(conn);
+  }
+
+  g_cond_signal(host->cond);
+  G_UNLOCK(http_hosts);
+}
+
+static void http_close_idle(gpointer key G_GNUC_UNUSED, NMHttpHost *host,
+                            time_t *now)
+{
+  NMHttpConnection *conn;
+
+  while ((conn = (NMHttpConnection *)g_queue_peek_tail(&host->idle)) &&
+         *now - conn->idle_since >= HTTP_IDLE_TIMEOUT)
+  {
+    g_queue_pop_tail(&host->idle);
+    host->open --;
+    http_connection_free(conn);
+    g_cond_signal(host->cond);
+  }
+}
+
+/* called periodically from the main loop */
+static gboolean http_expire_idle_connections(gpointer data G_GNUC_UNUSED)
+{
+  time_t now;
+
+  time(&now);
+
+  G_LOCK(http_hosts);
+  if (http_hosts)
+    g_hash_table_foreach(http_hosts, (GHFunc)http_close_idle, &now);
+  G_UNLOCK(http_hosts);
+
+  return TRUE;
+}
+
+static gssize http_fill(NMHttpConnection *conn)
+{
+  gssize len;
+
+  if (conn->start < conn->end)
+    return conn->end - conn->start;
+
+  do
+    len = recv(conn->fd, conn->buf, sizeof(conn->buf), 0);
+  while (len < 0 && errno == EINTR);
+
+  conn->start = 0;
+  conn->end = len > 0 ? len : 0;
+
+  return len;
+}
+
+/* reads a line without the trailing CRLF */
+static gboolean http_read_line(NMHttpConnection *conn, GString *line)
+{
+  g_string_truncate(line, 0);
+
+  while (http_fill(conn) > 0)
+  {
+    while (conn->start < conn->end)
+    {
+      gchar c = conn->buf[conn->start ++];
+
+      if (c == '\n')
+      {
+        if (line->len && line->str[line->len - 1] == '\r')
+          g_string_truncate(line, line->len - 1);
+
+        return TRUE;
+      }
+
+      if (line->len >= HTTP_MAX_LINE)
+        return FALSE;
+
+      g_string_append_c(line, c);
+    }
+  }
+
+  return FALSE;
+}
+
+/* passes len bytes of body to func (if any) */
+static gboolean http_read_body(NMHttpConnection *conn, gsize len,
+                               NMHttpDataFunc func, gpointer user_data)
+{
+  while (len)
+  {
+    gsize count;
+
+    if (http_fill(conn) <= 0)
+      return FALSE;
+
+    count = MIN(len, (gsize)(conn->end - conn->start));
+
+    if (func && !func(conn->buf + conn->start, count, user_data))
+      func = NULL;
+
+    conn->start += count;
+    len -= count;
+  }
+
+  return TRUE;
+}
+
+static gboolean http_read_chunked_body(NMHttpConnection *conn, GString *line,
+                                       NMHttpDataFunc func, gpointer user_data)
+{
+  guint64 total = 0;
+
+  while (1)
+  {
+    guint64 len;
+
+    if (!http_read_line(conn, line))
+      return FALSE;
+
+    len = g_ascii_strtoull(line->str, NULL, 16);
+
+    if (!len)
+      break;
+
+    total += len;
+    if (len > HTTP_MAX_BODY || total > HTTP_MAX_BODY)
+      return FALSE;
+
+    if (!http_read_body(conn, len, func, user_data) ||
+        !http_read_line(conn, line))
+      return FALSE;
+  }
+
+  /* trailers */
+  while (http_read_line(conn, line))
+  {
+    if (!line->len)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static gboolean http_read_until_close(NMHttpConnection *conn,
+                                      NMHttpDataFunc func, gpointer user_data)
+{
+  gsize total = 0;
+
+  while (http_fill(conn) > 0)
+  {
+    total += conn->end - conn->start;
+    if (total > HTTP_MAX_BODY)
+      return FALSE;
+
+    if (func && !func(conn->buf + conn->start, conn->end - conn->start,
+                      user_data))
+      func = NULL;
+
+    conn->start = conn->end;
+  }
+
+  return TRUE;
+}
+
+static gboolean http_send_all(int fd, const gchar *data, gsize len)
+{
+  while (len)
+  {
+    gssize sent = send(fd, data, len, MSG_NOSIGNAL);
+
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return FALSE;
+    }
+
+    data += sent;
+    len -= sent;
+  }
+
+  return TRUE;
+}
+
+/* Performs a single request on conn, returns the HTTP status code, 0 if the
+   (reused) connection turned out to be closed before anything was received,
+   -1 on other errors. The Location header, if any, is returned in location */
+static int http_exchange(NMHttpConnection *conn, const gchar *request,
+                         NMHttpDataFunc func, gpointer user_data,
+                         gboolean *reusable, gchar **location)
+{
+  GString *line = g_string_sized_new(128);
+  gssize content_length = -1;
+  gboolean chunked = FALSE;
+  guint headers = 0;
+  gboolean ok;
+  int code;
+
+  *reusable = FALSE;
+  conn->start = conn->end = 0;
+
+  if (!http_send_all(conn->fd, request, strlen(request)) ||
+      !http_read_line(conn, line))
+  {
+    g_string_free(line, TRUE);
+    return 0;
+  }
+
+  /* HTTP/1.x CODE reason */
+  if (!g_str_has_prefix(line->str, "HTTP/1.") || line->len < 12)
+  {
+    g_string_free(line, TRUE);
+    return -1;
+  }
+
+  code = atoi(line->str + 9);
+  *reusable = line->str[7] == '1';
+
+  while ((ok = http_read_line(conn, line)) && line->len)
+  {
+    gchar *value;
+
+    if (++ headers > HTTP_MAX_HEADERS)
+    {
+      ok = FALSE;
+      break;
+    }
+
+    value = strchr(line->str, ':');
+    if (!value)
+      continue;
+
+    *value ++ = 0;
+    g_strstrip(value);
+
+    if (!g_ascii_strcasecmp(line->str, "Content-Length"))
+    {
+      gint64 length = g_ascii_strtoll(value, NULL, 10);
+
+      if (length < 0 || length > HTTP_MAX_BODY)
+      {
+        ok = FALSE;
+        break;
+      }
+
+      content_length = length;
+    }
+    else if (!g_ascii_strcasecmp(line->str, "Transfer-Encoding"))
+      chunked = !g_ascii_strcasecmp(value, "chunked");
+    else if (!g_ascii_strcasecmp(line->str, "Location"))
+    {
+      g_free(*location);
+      *location = g_strdup(value);
+    }
+    else if (!g_ascii_strcasecmp(line->str, "Connection"))
+    {
+      if (!g_ascii_strcasecmp(value, "close"))
+        *reusable = FALSE;
+      else if (!g_ascii_strcasecmp(value, "keep-alive"))
+        *reusable = TRUE;
+    }
+  }
+
+  if (!ok)
+  {
+    *reusable = FALSE;
+    g_string_free(line, TRUE);
+    return -1;
+  }
+
+  /* the body of anything but success is read just to keep the connection */
+  if (code != 200)
+    func = NULL;
+
+  if (code == 204 || code == 304 || (code >= 100 && code < 200))
+    ok = TRUE;
+  else if (chunked)
+    ok = http_read_chunked_body(conn, line, func, user_data);
+  else if (content_length >= 0)
+    ok = http_read_body(conn, content_length, func, user_data);
+  else
+  {
+    ok = http_read_until_close(conn, func, user_data);
+    *reusable = FALSE;
+  }
+
+  if (!ok)
+    *reusable = FALSE;
+
+  g_string_free(line, TRUE);
+
+  return ok ? code : -1;
+}
+
+/* Performs a single GET, see http_get() */
+static int http_get_once(const char *url, const char *headers,
+                         NMHttpDataFunc func, gpointer user_data,
+                         gchar **location)
+{
+  const gchar *proxy = g_getenv("http_proxy");
+  const gchar *host_start;
+  const gchar *path;
+  gchar *host;
+  gchar *host_port;
+  gchar *request;
+  int code = -1;
+  int attempt;
+
+  if (g_ascii_strncasecmp(url, "http://", 7))
+  {
+    g_warning("Unsupported URL %s", url);
+    return -1;
+  }
+
+  host_start = url + 7;
+  path = strchr(host_start, '/');
+  if (!path)
+    path = host_start + strlen(host_start);
+
+  host = g_strndup(host_start, path - host_start);
+
+  if (proxy && g_str_has_prefix(proxy, "http://"))
+  {
+    const gchar *proxy_end;
+
+    proxy += 7;
+    proxy_end = strchr(proxy, '/');
+    host_port = g_strndup(proxy,
+                          proxy_end ? proxy_end - proxy : (gssize)strlen(proxy));
+    /* proxies want absolute URIs */
+    path = url;
+  }
+  else
+    host_port = g_strdup(host);
+
+  if (!strchr(host_port, ':'))
+  {
+    gchar *tmp = host_port;
+
+    host_port = g_strconcat(tmp, ":80", NULL);
+    g_free(tmp);
+  }
+
+  request = g_strdup_printf("GET %s HTTP/1.1\r\n"
+                            "Host: %s\r\n"
+                            "Connection: keep-alive\r\n"
+                            "%s"
+                            "\r\n",
+                            *path ? path : "/", host, headers ? headers : "");
+
+  /* a reused connection might have been closed by the server meanwhile, retry
+     once on a fresh one in that case */
+  for (attempt = 0; attempt < 2; attempt ++)
+  {
+    gboolean reused;
+    gboolean reusable;
+    NMHttpConnection *conn = http_connection_acquire(host_port, &reused);
+
+    if (!conn)
+      break;
+
+    g_free(*location);
+    *location = NULL;
+    code = http_exchange(conn, request, func, user_data, &reusable, location);
+    http_connection_release(conn, reusable);
+
+    if (code || !reused)
+      break;
+  }
+
+  if (!code)
+    code = -1;
+
+  g_free(request);
+  g_free(host_port);
+  g_free(host);
+
+  return code;
+}
+
+#define HTTP_MAX_REDIRECTS 5
+
+/* GETs url, passing the body of a 200 response to func chunk by chunk (func
+   returns FALSE if it is not interested in the rest). headers, if not NULL,
+   must be CRLF terminated. Redirects are followed, up to HTTP_MAX_REDIRECTS
+   of them. Returns the HTTP status code or -1 on error. */
+static int http_get(const char *url, const char *headers,
+                    NMHttpDataFunc func, gpointer user_data)
+{
+  gchar *current = g_strdup(url);
+  gchar *location = NULL;
+  int redirects = 0;
+  int code;
+
+  while (1)
+  {
+    xmlChar *next;
+
+    code = http_get_once(current, headers, func, user_data, &location);
+
+    if ((code != 301 && code != 302 && code != 303 && code != 307 &&
+         code != 308) || !location)
+      break;
+
+    if (redirects ++ == HTTP_MAX_REDIRECTS)
+    {
+      g_warning("Too many redirects for %s", url);
+      break;
+    }
+
+    /* Location might be relative */
+    next = xmlBuildURI((const xmlChar *)location, (const xmlChar *)current);
+    if (!next)
+      break;
+
+    g_free(current);
+    current = g_strdup((const gchar *)next);
+    xmlFree(next);
+  }
+
+  g_free(location);
+  g_free(current);
+
+  return code;
+}
+
+static gboolean http_append_to_buffer(const guchar *data, gsize len,
+                                      GByteArray *buffer)
+{
+  g_byte_array_append(buffer, data, len);
+
+  return TRUE;
+}
+
+/* Pulls the fields the replies need out of a geocoder response in a single
+   pass, while it is being received */
+static void geocode_parser_start(NMGeocodeParser *parser,
+                                 const xmlChar *localname,
+                                 const xmlChar *prefix G_GNUC_UNUSED,
+                                 const xmlChar *URI,
+                                 int nb_namespaces G_GNUC_UNUSED,
+                                 const xmlChar **namespaces G_GNUC_UNUSED,
+                                 int nb_attributes G_GNUC_UNUSED,
+                                 int nb_defaulted G_GNUC_UNUSED,
+                                 const xmlChar **attributes G_GNUC_UNUSED)
+{
+  const char *name = (const char *)localname;
+  int depth = ++parser->depth;
+  int field = -1;
+
+  if (depth == 1)
+  {
+    /* decides the namespace of the rest of the document */
+    if (URI && !strcmp(name, "places") &&
+        !strcmp((const char *)URI, "nokia:geocoder:gc:1.0"))
+    {
+      parser->ns = "nokia:geocoder:gc:1.0";
+    }
+    else if (URI && !strcmp(name, "response") &&
+             !strcmp((const char *)URI, "nokia:search:gc:1.0"))
+    {
+      parser->ns = "nokia:search:gc:1.0";
+    }
+  }
+
+  if (!parser->ns || !URI || strcmp((const char *)URI, parser->ns))
+    return;
+
+  if (depth == 2 && !strcmp(name, "place"))
+    parser->in_place = TRUE;
+  else if (depth == 3 && parser->in_place && !strcmp(name, parser->target))
+    parser->found = TRUE;
+
+  if (parser->capture_depth)
+    return;
+
+  if (!strcmp(name, "position"))
+    parser->position_depth = depth;
+  else if (!strcmp(name, "thoroughfare"))
+    parser->thoroughfare_depth = depth;
+  else if (!strcmp(name, "latitude"))
+  {
+    if (parser->position_depth == depth - 1)
+      field = GEOCODE_FIELD_LATITUDE;
+  }
+  else if (!strcmp(name, "longitude"))
+  {
+    if (parser->position_depth == depth - 1)
+      field = GEOCODE_FIELD_LONGITUDE;
+  }
+  else if (!strcmp(name, "name"))
+  {
+    if (parser->thoroughfare_depth == depth - 1)
+      field = GEOCODE_FIELD_STREET;
+  }
+  else if (!strcmp(name, "number"))
+  {
+    if (parser->thoroughfare_depth == depth - 1)
+      field = GEOCODE_FIELD_HOUSE_NUM;
+  }
+  else if (!strcmp(name, "country"))
+    field = GEOCODE_FIELD_COUNTRY;
+  else if (!strcmp(name, "countryCode"))
+    field = GEOCODE_FIELD_COUNTRY_CODE;
+  else if (!strcmp(name, "district"))
+    field = GEOCODE_FIELD_DISTRICT;
+  else if (!strcmp(name, "city"))
+    field = GEOCODE_FIELD_CITY;
+  else if (!strcmp(name, "postCode"))
+    field = GEOCODE_FIELD_POST_CODE;
+
+  /* the first one in the document wins */
+  if (field >= 0 && !parser->fields[field])
+  {
+    parser->field = field;
+    parser->capture_depth = depth;
+    g_string_truncate(parser->text, 0);
+  }
+}
+
+static void geocode_parser_end(NMGeocodeParser *parser,
+                               const xmlChar *localname G_GNUC_UNUSED,
+                               const xmlChar *prefix G_GNUC_UNUSED,
+                               const xmlChar *URI G_GNUC_UNUSED)
+{
+  int depth = parser->depth --;
+
+  if (parser->capture_depth == depth)
+  {
+    parser->fields[parser->field] = g_strdup(parser->text->str);
+    parser->capture_depth = 0;
+  }
+
+  if (parser->position_depth == depth)
+    parser->position_depth = 0;
+
+  if (parser->thoroughfare_depth == depth)
+    parser->thoroughfare_depth = 0;
+
+  if (depth == 2)
+    parser->in_place = FALSE;
+}
+
+static void geocode_parser_characters(NMGeocodeParser *parser,
+                                      const xmlChar *ch, int len)
+{
+  if (parser->capture_depth)
+    g_string_append_len(parser->text, (const gchar *)ch, len);
+}
+
+static gboolean geocode_parser_feed(const guchar *data, gsize len,
+                                    NMGeocodeParser *parser)
+{
+  if (xmlParseChunk(parser->ctxt, (const char *)data, len, 0) != XML_ERR_OK)
+    parser->error = TRUE;
+
+  return !parser->error;
+}
+
+/* Requests url and looks for /places/place/<target> (or
+   /response/place/<target> for the search namespace) in the response.
+   Returns -1 if the request failed, 0 if target was not found or the
+   response could not be parsed and 1 if it was found, fields are filled in
+   with what was found anyway. */
+static int geocode_request(const char *url, const char *target,
+                           gchar **fields)
+{
+  xmlSAXHandler sax;
+  NMGeocodeParser parser;
+  int code;
+
+  memset(&sax, 0, sizeof(sax));
+  sax.initialized = XML_SAX2_MAGIC;
+  sax.startElementNs = (startElementNsSAX2Func)geocode_parser_start;
+  sax.endElementNs = (endElementNsSAX2Func)geocode_parser_end;
+  sax.characters = (charactersSAXFunc)geocode_parser_characters;
+
+  memset(&parser, 0, sizeof(parser));
+  parser.target = target;
+  parser.fields = fields;
+  parser.text = g_string_new(NULL);
+  parser.ctxt = xmlCreatePushParserCtxt(&sax, &parser, NULL, 0, url);
+
+#pragma message "OVI maps no longer supports \"Referer: Maemo_SW\", please find a replacement or remove that message"
+
+  code = http_get(url,
+#if 0
+  /* FIXME - that breaks account status location, why? */
+                  "Referer: Maemo_SW\r\n",
+#else
+                  NULL,
+#endif
+                  (NMHttpDataFunc)geocode_parser_feed, &parser);
+
+  if (code == 200 && !parser.error &&
+      xmlParseChunk(parser.ctxt, NULL, 0, 1) != XML_ERR_OK)
+  {
+    parser.error = TRUE;
+  }
+
+  xmlFreeParserCtxt(parser.ctxt);
+  g_string_free(parser.text, TRUE);
+
+  /* received fine, but not what we expected */
+  if (parser.error)
+    return 0;
+
+  if (code != 200)
+    return -1;
+
+  return parser.found ? 1 : 0;
+}
+
+static void geocode_fields_free(gchar **fields)
+{
+  int i;
+
+  for (i = 0; i < GEOCODE_FIELD_COUNT; i ++)
+    g_free(fields[i]);
+}
+
+static gboolean can_go_online(NMProviderPrivate *priv, gboolean verbose)
+{
+  gboolean rv;
+
+  if (!verbose)
+    return TRUE;
+
+  g_mutex_lock(priv->con_ic_mutex);
+  rv = priv->con_ic_status != CON_IC_STATUS_DISCONNECTED ||
+      (priv->con_ic_error != CON_IC_CONNECTION_ERROR_USER_CANCELED &&
+       priv->con_ic_error != CON_IC_CONNECTION_ERROR_NONE);
+  g_mutex_unlock(priv->con_ic_mutex);
+
+  return rv;
+}
+
+static void con_ic_status_handler(ConIcConnection *conn G_GNUC_UNUSED,
+                                  ConIcConnectionEvent *event,
+                                  NMProviderPrivate *priv)
+{
+  g_mutex_lock(priv->con_ic_mutex);
+  priv->con_ic_status = con_ic_connection_event_get_status(event);
+  priv->con_ic_error = con_ic_connection_event_get_error(event);
+  priv->con_ic_pending = FALSE;
+  g_cond_broadcast(priv->con_ic_cond);
+  g_mutex_unlock(priv->con_ic_mutex);
+}
+
+/* Blocks the calling worker until conic reports the outcome of the connection
+   attempt. Only one attempt is made at a time, the rest of the workers simply
+   wait for its result. The event is delivered on the main loop, so the mutex
+   must not be held while calling into conic. */
+static void con_ic_connect(NMProviderPrivate *priv)
+{
+  g_mutex_lock(priv->con_ic_mutex);
+
+  if (priv->con_ic_stopped || g_atomic_int_get(&priv->con_ic_do_not_connect))
+  {
+    g_mutex_unlock(priv->con_ic_mutex);
+    return;
+  }
+
+  if (!priv->con_ic_conn)
+  {
+    priv->con_ic_conn = con_ic_connection_new();
+    g_object_set(G_OBJECT(priv->con_ic_conn),
+                 "automatic-connection-events", TRUE, NULL);
+
+    g_signal_connect_data(G_OBJECT(priv->con_ic_conn), "connection-event",
+                                   (GCallback)con_ic_status_handler,
+                                   priv, NULL, 0);
+    priv->con_ic_status = CON_IC_STATUS_DISCONNECTED;
+  }
+
+  if (!priv->con_ic_pending && priv->con_ic_status != CON_IC_STATUS_CONNECTED)
+  {
+    priv->con_ic_pending = TRUE;
+    g_mutex_unlock(priv->con_ic_mutex);
+    con_ic_connection_connect(priv->con_ic_conn, CON_IC_CONNECT_FLAG_NONE);
+    g_mutex_lock(priv->con_ic_mutex);
+  }
+
+  while (priv->con_ic_pending && !priv->con_ic_stopped)
+    g_cond_wait(priv->con_ic_cond, priv->con_ic_mutex);
+
+  if (!g_atomic_int_get(&priv->con_ic_do_not_connect) &&
+      priv->con_ic_status == CON_IC_STATUS_DISCONNECTED)
+  {
+    if (priv->con_ic_error == CON_IC_CONNECTION_ERROR_USER_CANCELED ||
+        priv->con_ic_error == CON_IC_CONNECTION_ERROR_NONE )
+      g_atomic_int_set(&priv->con_ic_do_not_connect, TRUE);
+  }
+
+  g_mutex_unlock(priv->con_ic_mutex);
+}
+
+/* Returns TRUE if the geocoder found the address */
+static gboolean geocode_fetch(const char *url, NavigationLocation *location)
+{
+  gchar *fields[GEOCODE_FIELD_COUNT] = { NULL };
+  int found = geocode_request(url, "location", fields);
+
+  if (found > 0)
+  {
+    location->latitude = g_ascii_strtod(
+          fields[GEOCODE_FIELD_LATITUDE] ? fields[GEOCODE_FIELD_LATITUDE] : "",
+          NULL);
+    location->longitude = g_ascii_strtod(
+          fields[GEOCODE_FIELD_LONGITUDE] ? fields[GEOCODE_FIELD_LONGITUDE] : "",
+          NULL);
+  }
+  else if (!found)
+    g_warning("Could not parse response");
+  else
+    g_warning("Could not connect to %s", url);
+
+  geocode_fields_free(fields);
+
+  return found > 0;
+}
+
+static void navigation_address_to_locations_reply(NMProviderThreadData *data,
+                                                  gboolean verbose)
+{
+  NMProviderPrivate *priv = data->provider->priv;
+  NMProviderGeocodeParams *params = (NMProviderGeocodeParams *)data->data;
+  NavigationLocation location = params->location;
+  DBusMessage *message;
+  gboolean found = params->cached;
+
+  if (!found)
+  {
+    if (!g_atomic_int_get(&priv->con_ic_do_not_connect))
+      con_ic_connect(priv);
+
+    if (!can_go_online(priv, verbose))
+    {
+      navigation_address_to_locations_error_reply(data,
+                                                  "AddressToLocationError");
+      return;
+    }
+
+    found = geocode_fetch(params->url, &location);
+
+    if (found)
+      geocode_cache_insert(priv, params->key, &location, time(NULL));
+  }
+
+  message = navigation_reply_new(data, "AddressToLocationsReply");
+  if (message)
+  {
+    DBusMessageIter entry;
+    DBusMessageIter array;
+
+    dbus_message_iter_init_append(message, &array);
+    dbus_message_iter_open_container(&array, DBUS_TYPE_ARRAY, "(dd)", &entry);
+
+    if (found)
+    {
+      DBusMessageIter loc;
+
+      dbus_message_iter_open_container(&entry, DBUS_TYPE_STRUCT, NULL, &loc);
+      dbus_message_iter_append_basic(&loc, DBUS_TYPE_DOUBLE,
+                                     &location.latitude);
+      dbus_message_iter_append_basic(&loc, DBUS_TYPE_DOUBLE,
+                                     &location.longitude);
+      dbus_message_iter_close_container(&entry, &loc);
+    }
+
+    dbus_message_iter_close_container(&array, &entry);
+    dbus_connection_send(priv->dbus, message, 0);
+    dbus_message_unref(message);
+  }
+}
+
+static dbus_bool_t iter_append_safe(DBusMessageIter *iter, char *value)
+{
+  const char *s = "";
+
+  if (value)
+    return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &value);
+
+  return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &s);
+}
+
+static dbus_bool_t append_dbus_location_data(DBusMessageIter *array,
+                                             NavigationAddress *address)
+{
+  DBusMessageIter elem;
+
+  dbus_message_iter_open_container(array, DBUS_TYPE_ARRAY,
+                                   DBUS_TYPE_STRING_AS_STRING, &elem);
+  iter_append_safe(&elem, address->house_num);
+  iter_append_safe(&elem, address->house_name);
+  iter_append_safe(&elem, address->street);
   iter_append_safe(&elem, address->suburb);
   iter_append_safe(&elem, address->town);
   iter_append_safe(&elem, address->municipality);
@@ -1087,309 +3407,2568 @@ static dbus_bool_t append_dbus_location_data(DBusMessageIter *array,
   iter_append_safe(&elem, address->country_code);
   iter_append_safe(&elem, address->time_zone);
 
-  return dbus_message_iter_close_container(array, &elem);
+  return dbus_message_iter_close_container(array, &elem);
+}
+
+static NavigationAddress *location_to_address_fetch(
+    NMProviderPrivate *priv,
+    const NavigationLocation *location)
+{
+  char lon[G_ASCII_DTOSTR_BUF_SIZE];
+  char lat[G_ASCII_DTOSTR_BUF_SIZE];
+  gchar *http_req;
+  gchar *fields[GEOCODE_FIELD_COUNT] = { NULL };
+  NavigationAddress *address = NULL;
+  int found;
+
+  if (g_atomic_int_get(&priv->con_ic_do_not_connect))
+    return NULL;
+
+  con_ic_connect(priv);
+  g_ascii_dtostr(lat, sizeof(lat), location->latitude);
+  g_ascii_dtostr(lon, sizeof(lon), location->longitude);
+  http_req = g_strdup_printf(
+        "%s/rgc/1.0?total=1&lat=%s&long=%s&token=%s",
+        priv->provider_url,
+        lat,
+        lon,
+        "9b87b24dffafdfcb6dfc66eeba834caa");
+
+  found = geocode_request(http_req, "address", fields);
+  if (found > 0)
+  {
+    /* the fields are handed over to the address */
+    address = (NavigationAddress *)g_malloc0(sizeof(NavigationAddress));
+    address->country = fields[GEOCODE_FIELD_COUNTRY];
+    address->country_code = fields[GEOCODE_FIELD_COUNTRY_CODE];
+    address->suburb = fields[GEOCODE_FIELD_DISTRICT];
+    address->town = fields[GEOCODE_FIELD_CITY];
+    address->postal_code = fields[GEOCODE_FIELD_POST_CODE];
+    address->street = fields[GEOCODE_FIELD_STREET];
+    address->house_num = fields[GEOCODE_FIELD_HOUSE_NUM];
+    g_free(fields[GEOCODE_FIELD_LATITUDE]);
+    g_free(fields[GEOCODE_FIELD_LONGITUDE]);
+
+    if (priv->provider_twn &&
+        g_strrstr_len(address->country, 6, "TAIWAN"))
+    {
+      g_free(address->country);
+      address->country = g_strdup("TAIWAN");
+    }
+  }
+  else
+  {
+    if (!found)
+      g_warning("Could not parse response");
+    else
+      g_warning("Could not connect to %s", http_req);
+
+    geocode_fields_free(fields);
+  }
+
+  g_free(http_req);
+
+  return address;
+}
+
+static void navigation_fetch_job_func(NMProviderFetchJob *job,
+                                      NMProviderPrivate *priv)
+{
+  NMProviderFetchBatch *batch = job->batch;
+
+  job->func(job->data, priv);
+  g_slice_free(NMProviderFetchJob, job);
+
+  g_mutex_lock(batch->mutex);
+  batch->pending --;
+  /* for both navigation_fetch_batch_wait() and _throttle() */
+  g_cond_signal(batch->cond);
+  g_mutex_unlock(batch->mutex);
+}
+
+static NMProviderFetchBatch *navigation_fetch_batch_new(void)
+{
+  NMProviderFetchBatch *batch = g_slice_new(NMProviderFetchBatch);
+
+  batch->mutex = g_mutex_new();
+  batch->cond = g_cond_new();
+  batch->pending = 0;
+
+  return batch;
+}
+
+static void navigation_fetch_batch_push(NMProviderPrivate *priv,
+                                        NMProviderFetchBatch *batch,
+                                        GFunc func, gpointer data)
+{
+  NMProviderFetchJob *job = g_slice_new(NMProviderFetchJob);
+
+  job->func = func;
+  job->data = data;
+  job->batch = batch;
+
+  g_mutex_lock(batch->mutex);
+  batch->pending ++;
+  g_mutex_unlock(batch->mutex);
+
+  g_thread_pool_push(priv->fetch_pool, job, NULL);
+}
+
+/* Waits until less than max jobs of the batch are pending */
+static void navigation_fetch_batch_throttle(NMProviderFetchBatch *batch,
+                                            int max)
+{
+  g_mutex_lock(batch->mutex);
+  while (batch->pending >= max)
+    g_cond_wait(batch->cond, batch->mutex);
+  g_mutex_unlock(batch->mutex);
+}
+
+/* Waits for all the jobs pushed to the batch and frees it */
+static void navigation_fetch_batch_wait(NMProviderFetchBatch *batch)
+{
+  g_mutex_lock(batch->mutex);
+  while (batch->pending)
+    g_cond_wait(batch->cond, batch->mutex);
+  g_mutex_unlock(batch->mutex);
+
+  g_cond_free(batch->cond);
+  g_mutex_free(batch->mutex);
+  g_slice_free(NMProviderFetchBatch, batch);
+}
+
+/* Returns a copy of the cached address of the location, if any */
+static NavigationAddress *location_to_address_cached(
+    NMProviderPrivate *priv,
+    const NavigationLocation *location)
+{
+  NMProviderLocation *provider_location;
+  NavigationAddress *address = NULL;
+  NavigationLocation key = *location;
+
+  location_quantize(priv, &key);
+
+  G_LOCK(hash_table);
+  provider_location = location_cache_lookup(priv, &key);
+  if (provider_location && location_address(provider_location))
+  {
+    /* another worker might evict the entry as soon as we unlock */
+    address = navigation_address_copy(location_address(provider_location));
+    location_cache_touch(priv, provider_location);
+  }
+  G_UNLOCK(hash_table);
+
+  return address;
+}
+
+/* Looks the location up in the cache and asks the server if it is not
+   there, returns a copy of the address the caller must free */
+static NavigationAddress *location_to_address_resolve(
+    NMProviderPrivate *priv,
+    const NavigationLocation *location)
+{
+  NavigationAddress *address;
+  NavigationLocation key;
+
+  address = location_to_address_cached(priv, location);
+  if (address || g_atomic_int_get(&priv->con_ic_do_not_connect))
+    return address;
+
+  /* the server is asked about the exact location, but the result is cached
+     for the whole cell */
+  key = *location;
+  location_quantize(priv, &key);
+
+  /* the same location might be being resolved by another worker already,
+     share its result instead of asking the server again */
+  if (navigation_flight_begin(&priv->loc_flights, &key, (gpointer *)&address))
+  {
+    NavigationAddress *fetched = location_to_address_fetch(priv, location);
+
+    if (fetched)
+    {
+      NMProviderLocation *provider_location =
+          (NMProviderLocation *)g_malloc0(sizeof(NMProviderLocation));
+
+      time(&provider_location->timestamp);
+      provider_location->last_used = provider_location->timestamp;
+      provider_location->navigation_data = fetched;
+      provider_location->ref_cnt = 1;
+      address = navigation_address_copy(fetched);
+
+      /* complete the flight only once the result is in the cache, so
+         nobody ends up fetching it again in between. The waiters get
+         their copy before the insert, which might evict it right away */
+      G_LOCK(hash_table);
+      navigation_flight_end(&priv->loc_flights, &key, fetched);
+      location_cache_insert(priv, &key, provider_location);
+      G_UNLOCK(hash_table);
+    }
+    else
+      navigation_flight_end(&priv->loc_flights, &key, NULL);
+  }
+
+  return address;
+}
+
+static void navigation_location_to_address_reply(
+    NMProviderThreadData *thread_data,
+    gboolean verbose)
+{
+  NMProviderPrivate *priv = thread_data->provider->priv;
+  NavigationAddress *address;
+  DBusMessage *message;
+  DBusMessageIter sub;
+  DBusMessageIter iter;
+
+  message = navigation_reply_new(thread_data, "LocationToAddressReply");
+  if (!message)
+    return;
+
+  dbus_message_iter_init_append(message, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "as", &sub);
+
+  address = location_to_address_resolve(
+        priv, (NavigationLocation *)thread_data->data);
+
+  if (address)
+  {
+    append_dbus_location_data(&sub, address);
+    navigation_address_free(address);
+  }
+  else if (!can_go_online(priv, verbose))
+  {
+    dbus_message_iter_close_container(&iter, &sub);
+    dbus_message_unref(message);
+    navigation_address_to_locations_error_reply(thread_data,
+                                                "LocationToAddressError");
+    return;
+  }
+
+  dbus_message_iter_close_container(&iter, &sub);
+  dbus_connection_send(priv->dbus, message, 0);
+  dbus_message_unref(message);
+}
+
+/* runs in the fetch pool */
+static void location_to_address_job(NMProviderLocationJob *job,
+                                    NMProviderPrivate *priv)
+{
+  if (!g_atomic_int_get(job->cancelled))
+    job->address = location_to_address_resolve(priv, job->location);
+}
+
+/* Cached locations are answered straight away, the rest are resolved
+   concurrently in the fetch pool. The reply carries a status and an address
+   (empty unless found) for every location, in the order they were asked */
+static void navigation_locations_to_addresses_reply(
+    NMProviderThreadData *thread_data,
+    gboolean verbose)
+{
+  NMProviderPrivate *priv = thread_data->provider->priv;
+  NMProviderLocationsParams *params =
+      (NMProviderLocationsParams *)thread_data->data;
+  NMProviderLocationJob *jobs;
+  NMProviderFetchBatch *batch = NULL;
+  DBusMessage *message;
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  guint not_found = LOCATION_STATUS_NOT_FOUND;
+  guint i;
+
+  jobs = g_new0(NMProviderLocationJob, params->count);
+
+  for (i = 0; i < params->count; i ++)
+  {
+    jobs[i].location = &params->locations[i];
+    jobs[i].cancelled = &thread_data->cancelled;
+    jobs[i].address = location_to_address_cached(priv, jobs[i].location);
+
+    if (!jobs[i].address)
+    {
+      if (!batch)
+        batch = navigation_fetch_batch_new();
+
+      /* leave the rest of the fetch pool to the map tiles, a big batch would
+         hold them up otherwise */
+      navigation_fetch_batch_throttle(batch, MAX(priv->max_downloads / 2, 1));
+      navigation_fetch_batch_push(priv, batch, (GFunc)location_to_address_job,
+                                  &jobs[i]);
+    }
+  }
+
+  if (batch)
+  {
+    navigation_fetch_batch_wait(batch);
+
+    if (!can_go_online(priv, verbose))
+      not_found = LOCATION_STATUS_OFFLINE;
+  }
+
+  message = NULL;
+  if (!g_atomic_int_get(&thread_data->cancelled))
+  {
+    message = navigation_reply_new(thread_data, "LocationsToAddressesReply");
+  }
+
+  if (message)
+  {
+    dbus_message_iter_init_append(message, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(uas)", &array);
+  }
+
+  for (i = 0; i < params->count; i ++)
+  {
+    NavigationAddress *address = jobs[i].address;
+
+    if (message)
+    {
+      DBusMessageIter item;
+      DBusMessageIter sub;
+      guint status = (address ? LOCATION_STATUS_FOUND : not_found);
+
+      dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &item);
+      dbus_message_iter_append_basic(&item, DBUS_TYPE_UINT32, &status);
+
+      if (address)
+        append_dbus_location_data(&item, address);
+      else
+      {
+        dbus_message_iter_open_container(&item, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING, &sub);
+        dbus_message_iter_close_container(&item, &sub);
+      }
+
+      dbus_message_iter_close_container(&array, &item);
+    }
+
+    if (address)
+      navigation_address_free(address);
+  }
+
+  g_free(jobs);
+
+  if (message)
+  {
+    dbus_message_iter_close_container(&iter, &array);
+    dbus_connection_send(priv->dbus, message, 0);
+    dbus_message_unref(message);
+  }
+}
+
+/* Returns the tile exactly as sent by the server (png8) */
+static GByteArray *download_tile(NMProviderPrivate *priv, const char *url)
+{
+  GByteArray *data;
+  int code;
+
+  if (g_atomic_int_get(&priv->con_ic_do_not_connect))
+    return NULL;
+
+  con_ic_connect(priv);
+
+  data = g_byte_array_new();
+  code = http_get(url, "Referer: Maemo_SW\r\n",
+                  (NMHttpDataFunc)http_append_to_buffer, data);
+
+  if (code != 200 || !data->len)
+  {
+    if (code > 0 && code != 200)
+      g_warning("HTTP return code: %d", code);
+
+    g_warning("Failed to download map tile: %s", url);
+    g_byte_array_free(data, TRUE);
+
+    return NULL;
+  }
+
+  return data;
+}
+
+static GdkPixbuf *decode_tile(const guchar *data, gsize len)
+{
+  GdkPixbuf *rv = NULL;
+  GdkPixbufLoader *loader;
+  GError *error = NULL;
+
+  loader = gdk_pixbuf_loader_new();
+
+  if (!gdk_pixbuf_loader_write(loader, data, len, &error))
+  {
+    g_warning("Error loading map tile: %s\n", error->message);
+    g_error_free(error);
+  }
+
+  if (gdk_pixbuf_loader_close(loader, NULL))
+    rv = (GdkPixbuf *)g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+
+  g_object_unref(G_OBJECT(loader));
+
+  return rv;
+}
+
+#define TILE_SIZE 256
+
+/* the mapoptions bits selecting the tiles, the rest only affect the reply */
+#define MAP_TILE_OPTIONS 0x1F
+/* GetMapTile replies with GetMapTileFdReply, pixels in a sealed memfd */
+#define MAP_OPTION_FD_REPLY 0x100
+
+/* image format of the replies */
+#define MAP_OPTION_FORMAT 0x600
+/* GdkPixdata, RGBA */
+#define MAP_FORMAT_PIXDATA 0
+#define MAP_FORMAT_PNG 0x200
+/* GdkPixdata, RGB without alpha */
+#define MAP_FORMAT_RGB 0x400
+/* NMProviderRGB565Header followed by the rows */
+#define MAP_FORMAT_RGB565 0x600
+
+#define MAP_RGB565_MAGIC 0x35363552 /* "R565" */
+
+#if defined(DBUS_TYPE_UNIX_FD) && defined(SYS_memfd_create)
+#define HAVE_MEMFD_REPLY 1
+
+/* not in older libc headers */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+#endif
+
+/* zoom, x and y of a tile (and the tile type) packed in 64 bits, x and y
+   are masked so an out of range one can't spill into the other fields */
+#define TILE_KEY(zoom, x, y, mapoptions) \
+  (((guint64)(zoom) << 56) | ((guint64)((mapoptions) & 0xFF) << 48) | \
+   ((guint64)((x) & 0xFFFFFF) << 24) | (guint64)((y) & 0xFFFFFF))
+
+#define TILE_KEY_ZOOM(key) ((int)((key) >> 56))
+#define TILE_KEY_MAPOPTIONS(key) ((int)(((key) >> 48) & 0xFF))
+#define TILE_KEY_X(key) ((int)(((key) >> 24) & 0xFFFFFF))
+#define TILE_KEY_Y(key) ((int)((key) & 0xFFFFFF))
+
+/* evict down to that percentage of the quota, so unlinks come in batches */
+#define TILE_CACHE_LOW_WATERMARK 90
+
+#define TILE_INDEX_FILE ".index"
+#define TILE_INDEX_MAGIC 0x49544D4E /* "NMTI" */
+#define TILE_INDEX_VERSION 2
+#define TILE_INDEX_SAVE_INTERVAL 300
+/* tiles loaded at once, before giving the requests a chance */
+#define TILE_INDEX_LOAD_BATCH 512
+
+#define TILE_STORE_INDEX_FILE "tiles.index"
+#define TILE_STORE_SEGMENT_FILE "tiles.%u.seg"
+#define TILE_STORE_SEGMENT_SIZE (16 * 1024 * 1024)
+#define TILE_STORE_RECORD_MAGIC 0x52544D4E /* "NMTR" */
+/* records are 8 bytes aligned */
+#define TILE_STORE_RECORD_SIZE(len) \
+  ((sizeof(NMProviderSegmentRecord) + (len) + 7) & ~7)
+#define TILE_NO_SEGMENT G_MAXUINT32
+
+#define long2x(lon) ((lon + 180.0) / 360.0)
+#define deg2rad(deg) deg * M_PI / 180
+
+static double lat2y(double lat)
+{
+  lat = deg2rad(lat);
+  double y = log(tan(lat) + (1/cos(lat)));
+
+  return (M_PI- y) / (2 * M_PI);
+}
+
+double y2lat(double y, double n)
+{
+  return
+      (atan(exp((2.0 * (1.0 - y / n) - 1.0) * M_PI)) - M_PI/4) * 360.0 / M_PI;
+}
+
+double x2long(double x, double n)
+{
+  return ((2 * x / n) - 1.0) * 180.0;
+}
+
+inline static int roundup256(int n)
+{
+ int r = n % 256;
+ return r ? n + 256 - r : n;
+}
+
+/* The disk cache index, tiles are looked up by their packed key and kept in
+   most recently used first order, so neither needs any filesystem access */
+static gchar *tile_cache_filename(NMProviderPrivate *priv, guint64 key)
+{
+  return g_strdup_printf("%s/%02d%06d%06d%02d.png",
+                         priv->cache_dir,
+                         TILE_KEY_ZOOM(key),
+                         TILE_KEY_X(key),
+                         TILE_KEY_Y(key),
+                         TILE_KEY_MAPOPTIONS(key));
+}
+
+static gboolean tile_cache_over_quota(NMProviderPrivate *priv, int percent)
+{
+  return priv->tile_index_size > priv->cache_max_size * percent / 100 ||
+      g_hash_table_size(priv->tile_index) >
+      (guint64)priv->cache_max_files * percent / 100;
+}
+
+static gchar *tile_store_segment_filename(NMProviderPrivate *priv, guint id)
+{
+  return g_strdup_printf("%s/" TILE_STORE_SEGMENT_FILE, priv->cache_dir, id);
+}
+
+/* The bytes taken by removed or replaced tiles, until the segments holding
+   them get compacted. Must be called with tile_index locked */
+static guint64 tile_store_dead_size(NMProviderPrivate *priv)
+{
+  GHashTableIter iter;
+  NMProviderSegment *seg;
+  guint64 dead = 0;
+
+  g_hash_table_iter_init(&iter, priv->segments);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&seg))
+  {
+    if (seg != priv->write_segment && seg->live < seg->size)
+      dead += seg->size - seg->live;
+  }
+
+  return dead;
+}
+
+/* the segments take that much on disk, not only the live tiles */
+static gboolean tile_store_over_quota(NMProviderPrivate *priv)
+{
+  return priv->packed_cache && priv->tile_index_loaded &&
+      priv->tile_index_size + tile_store_dead_size(priv) >
+      priv->cache_max_size;
+}
+
+/* must be called with tile_index locked */
+static void tile_store_map_unref(NMProviderSegmentMap *map)
+{
+  if (!--map->ref_cnt)
+  {
+    g_mapped_file_free(map->file);
+    g_slice_free(NMProviderSegmentMap, map);
+  }
+}
+
+static void tile_store_view_release(NMProviderSegmentMap *map)
+{
+  G_LOCK(tile_index);
+  tile_store_map_unref(map);
+  G_UNLOCK(tile_index);
+}
+
+/* Returns the segment, creating it if needed. Must be called with
+   tile_index locked */
+static NMProviderSegment *tile_store_segment_get(NMProviderPrivate *priv,
+                                                 guint id, gsize size)
+{
+  NMProviderSegment *seg = (NMProviderSegment *)
+      g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(id));
+
+  if (!seg)
+  {
+    seg = g_slice_new0(NMProviderSegment);
+    seg->id = id;
+    seg->size = size;
+    g_hash_table_insert(priv->segments, GUINT_TO_POINTER(id), seg);
+
+    if (id >= priv->next_segment)
+      priv->next_segment = id + 1;
+  }
+
+  return seg;
+}
+
+/* Same as above, but only for segments which exist on disk. Must be called
+   with tile_index locked */
+static NMProviderSegment *tile_store_segment_open(NMProviderPrivate *priv,
+                                                  guint id)
+{
+  NMProviderSegment *seg = (NMProviderSegment *)
+      g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(id));
+
+  if (!seg)
+  {
+    gchar *filename = tile_store_segment_filename(priv, id);
+    struct stat st;
+
+    if (!stat(filename, &st))
+      seg = tile_store_segment_get(priv, id, st.st_size);
+
+    g_free(filename);
+  }
+
+  return seg;
+}
+
+/* must be called with tile_index locked */
+static void tile_store_segment_free(NMProviderPrivate *priv,
+                                    NMProviderSegment *seg)
+{
+  g_hash_table_remove(priv->segments, GUINT_TO_POINTER(seg->id));
+
+  if (seg->map)
+    tile_store_map_unref(seg->map);
+
+  g_slice_free(NMProviderSegment, seg);
+}
+
+/* Returns a new reference to the mapping holding the tile, remapping the
+   segment if it grew since. Must be called with tile_index locked */
+static NMProviderSegmentMap *tile_store_view(NMProviderPrivate *priv,
+                                             NMProviderCachedTile *tile,
+                                             const guchar **data, gsize *len)
+{
+  NMProviderSegment *seg = (NMProviderSegment *)
+      g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(tile->segment));
+  const NMProviderSegmentRecord *record;
+
+  if (!seg)
+    return NULL;
+
+  if (!seg->map ||
+      g_mapped_file_get_length(seg->map->file) < tile->offset + tile->size)
+  {
+    gchar *filename = tile_store_segment_filename(priv, seg->id);
+    GMappedFile *file = g_mapped_file_new(filename, FALSE, NULL);
+
+    g_free(filename);
+
+    if (seg->map)
+      tile_store_map_unref(seg->map);
+
+    seg->map = NULL;
+
+    if (!file)
+      return NULL;
+
+    seg->map = g_slice_new(NMProviderSegmentMap);
+    seg->map->file = file;
+    seg->map->ref_cnt = 1;
+
+    if (g_mapped_file_get_length(file) < tile->offset + tile->size)
+      return NULL;
+  }
+
+  record = (const NMProviderSegmentRecord *)
+      (g_mapped_file_get_contents(seg->map->file) + tile->offset);
+
+  if (record->magic != TILE_STORE_RECORD_MAGIC || record->key != tile->key ||
+      TILE_STORE_RECORD_SIZE(record->len) != tile->size)
+  {
+    return NULL;
+  }
+
+  *data = (const guchar *)(record + 1);
+  *len = record->len;
+  seg->map->ref_cnt ++;
+
+  return seg->map;
+}
+
+static gboolean tile_store_write_all(int fd, const gchar *data, gsize len)
+{
+  while (len)
+  {
+    gssize written = write(fd, data, len);
+
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return FALSE;
+    }
+
+    data += written;
+    len -= written;
+  }
+
+  return TRUE;
+}
+
+/* Returns the length of the complete records at the start of the segment */
+static gsize tile_store_records_len(const gchar *contents, gsize len)
+{
+  gsize offset = 0;
+
+  while (offset + sizeof(NMProviderSegmentRecord) <= len)
+  {
+    const NMProviderSegmentRecord *record =
+        (const NMProviderSegmentRecord *)(contents + offset);
+
+    if (record->magic != TILE_STORE_RECORD_MAGIC ||
+        offset + TILE_STORE_RECORD_SIZE(record->len) > len)
+    {
+      break;
+    }
+
+    offset += TILE_STORE_RECORD_SIZE(record->len);
+  }
+
+  return offset;
+}
+
+/* Continues appending to the newest segment, so every restart doesn't leave
+   another partially filled one behind. A segment with a broken record at its
+   end (the provider got killed while writing it) is left alone, the index
+   loader might be reading it. Must be called with tile_store locked */
+static void tile_store_reopen(NMProviderPrivate *priv)
+{
+  GDir *dir = g_dir_open(priv->cache_dir, 0, NULL);
+  const gchar *fname;
+  gchar *filename;
+  GMappedFile *mapped;
+  gboolean found = FALSE;
+  guint last = 0;
+  gsize len = 0;
+
+  if (!dir)
+    return;
+
+  while ((fname = g_dir_read_name(dir)))
+  {
+    guint id;
+
+    if (g_str_has_suffix(fname, ".seg") &&
+        sscanf(fname, TILE_STORE_SEGMENT_FILE, &id) == 1 &&
+        (!found || id > last))
+    {
+      last = id;
+      found = TRUE;
+    }
+  }
+
+  g_dir_close(dir);
+
+  if (!found)
+    return;
+
+  filename = tile_store_segment_filename(priv, last);
+  mapped = g_mapped_file_new(filename, FALSE, NULL);
+
+  if (mapped)
+  {
+    len = g_mapped_file_get_length(mapped);
+
+    if (len < TILE_STORE_SEGMENT_SIZE &&
+        tile_store_records_len(g_mapped_file_get_contents(mapped), len) == len)
+    {
+      priv->write_fd = open(filename, O_WRONLY | O_APPEND);
+    }
+
+    g_mapped_file_free(mapped);
+  }
+
+  if (priv->write_fd >= 0)
+  {
+    G_LOCK(tile_index);
+    priv->write_segment = tile_store_segment_get(priv, last, len);
+    priv->write_segment->size = len;
+    G_UNLOCK(tile_index);
+    priv->write_offset = len;
+  }
+
+  g_free(filename);
+}
+
+/* Tiles are appended to the current segment, a new one is started once it
+   reaches TILE_STORE_SEGMENT_SIZE. Returns where the tile was written. */
+static gboolean tile_store_write(NMProviderPrivate *priv, guint64 key,
+                                 time_t timestamp, const guchar *data,
+                                 gsize len, guint32 *segment, guint32 *offset)
+{
+  NMProviderSegmentRecord *record;
+  gsize size = TILE_STORE_RECORD_SIZE(len);
+  gboolean rv = FALSE;
+
+  record = (NMProviderSegmentRecord *)g_malloc0(size);
+  record->magic = TILE_STORE_RECORD_MAGIC;
+  record->len = len;
+  record->key = key;
+  record->timestamp = timestamp;
+  memcpy(record + 1, data, len);
+
+  G_LOCK(tile_store);
+
+  /* first write since the start */
+  if (priv->write_fd < 0 && !priv->write_segment)
+    tile_store_reopen(priv);
+
+  if (priv->write_fd < 0 ||
+      priv->write_offset + size > TILE_STORE_SEGMENT_SIZE)
+  {
+    gchar *filename = NULL;
+    guint id;
+
+    if (priv->write_fd >= 0)
+      close(priv->write_fd);
+
+    G_LOCK(tile_index);
+    id = priv->next_segment;
+    G_UNLOCK(tile_index);
+
+    /* next_segment is not known before the index is loaded, never overwrite
+       a segment which is already there */
+    do
+    {
+      g_free(filename);
+      filename = tile_store_segment_filename(priv, id ++);
+      priv->write_fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0660);
+    }
+    while (priv->write_fd < 0 && errno == EEXIST);
+
+    priv->write_offset = 0;
+
+    if (priv->write_fd < 0)
+      g_warning("Could not create tile store segment %s", filename);
+    else
+    {
+      G_LOCK(tile_index);
+      priv->write_segment = tile_store_segment_get(priv, id - 1, 0);
+      G_UNLOCK(tile_index);
+    }
+
+    g_free(filename);
+  }
+
+  if (priv->write_fd >= 0)
+  {
+    if (tile_store_write_all(priv->write_fd, (const gchar *)record, size))
+    {
+      *segment = priv->write_segment->id;
+      *offset = priv->write_offset;
+      priv->write_offset += size;
+      rv = TRUE;
+    }
+    else
+    {
+      /* don't append after a partial record */
+      g_warning("Writing to tile store failed: %s", g_strerror(errno));
+      close(priv->write_fd);
+      priv->write_fd = -1;
+    }
+
+    G_LOCK(tile_index);
+    priv->write_segment->size = priv->write_offset;
+    G_UNLOCK(tile_index);
+  }
+
+  G_UNLOCK(tile_store);
+  g_free(record);
+
+  return rv;
+}
+
+/* must be called with tile_index locked */
+static void tile_index_unlink(NMProviderPrivate *priv,
+                              NMProviderCachedTile *tile)
+{
+  g_queue_unlink(&priv->tile_lru, &tile->link);
+  g_hash_table_remove(priv->tile_index, &tile->key);
+  priv->tile_index_size -= tile->size;
+  priv->tile_index_dirty = TRUE;
+
+  if (tile->segment != TILE_NO_SEGMENT)
+  {
+    NMProviderSegment *seg = (NMProviderSegment *)
+        g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(tile->segment));
+
+    if (!seg)
+      return;
+
+    seg->live -= tile->size;
+
+    /* mostly dead, worth moving the rest out */
+    if (seg != priv->write_segment && seg->live * 2 < seg->size)
+    {
+      priv->tile_store_compact = TRUE;
+      g_cond_signal(priv->evict_cond);
+    }
+  }
+}
+
+/* must be called with tile_index locked */
+static void tile_index_link(NMProviderPrivate *priv,
+                            NMProviderCachedTile *tile, gboolean recent)
+{
+  tile->link.data = tile;
+  tile->link.prev = tile->link.next = NULL;
+  g_hash_table_insert(priv->tile_index, &tile->key, tile);
+
+  if (recent)
+    g_queue_push_head_link(&priv->tile_lru, &tile->link);
+  else
+    g_queue_push_tail_link(&priv->tile_lru, &tile->link);
+
+  priv->tile_index_size += tile->size;
+  priv->tile_index_dirty = TRUE;
+
+  if (tile->segment != TILE_NO_SEGMENT)
+  {
+    NMProviderSegment *seg = (NMProviderSegment *)
+        g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(tile->segment));
+
+    if (seg)
+      seg->live += tile->size;
+  }
+}
+
+/* must be called with tile_index locked */
+static void tile_index_insert(NMProviderPrivate *priv,
+                              NMProviderCachedTile *tile)
+{
+  NMProviderCachedTile *old =
+      (NMProviderCachedTile *)g_hash_table_lookup(priv->tile_index, &tile->key);
+
+  if (old)
+  {
+    tile_index_unlink(priv, old);
+    g_slice_free(NMProviderCachedTile, old);
+  }
+
+  tile_index_link(priv, tile, TRUE);
+
+  if (tile_cache_over_quota(priv, 100))
+    g_cond_signal(priv->evict_cond);
+  else if (!priv->tile_store_compact && tile_store_over_quota(priv))
+  {
+    priv->tile_store_compact = TRUE;
+    priv->tile_store_compact_all = TRUE;
+    g_cond_signal(priv->evict_cond);
+  }
+}
+
+/* Moves the tiles still in use out of the mostly dead segments (all the
+   segments with dead tiles, when those take the cache over its quota) and
+   removes them. Called with tile_index locked, unlocks it while copying. */
+static void tile_store_compact(NMProviderPrivate *priv)
+{
+  GHashTableIter iter;
+  NMProviderSegment *seg;
+  GSList *segments = NULL;
+  GSList *l;
+  gboolean all = priv->tile_store_compact_all;
+
+  priv->tile_store_compact = FALSE;
+  priv->tile_store_compact_all = FALSE;
+
+  g_hash_table_iter_init(&iter, priv->segments);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&seg))
+  {
+    if (seg != priv->write_segment &&
+        (seg->live * 2 < seg->size || (all && seg->live < seg->size)))
+      segments = g_slist_prepend(segments, GUINT_TO_POINTER(seg->id));
+  }
+
+  for (l = segments; l; l = l->next)
+  {
+    guint id = GPOINTER_TO_UINT(l->data);
+    GArray *keys = g_array_new(FALSE, FALSE, sizeof(guint64));
+    GList *link;
+    guint i;
+
+    for (link = g_queue_peek_head_link(&priv->tile_lru); link;
+         link = link->next)
+    {
+      NMProviderCachedTile *tile = (NMProviderCachedTile *)link->data;
+
+      if (tile->segment == id)
+        g_array_append_val(keys, tile->key);
+    }
+
+    for (i = 0; i < keys->len; i ++)
+    {
+      guint64 key = g_array_index(keys, guint64, i);
+      NMProviderCachedTile *tile = (NMProviderCachedTile *)
+          g_hash_table_lookup(priv->tile_index, &key);
+      NMProviderSegmentMap *map;
+      const guchar *data;
+      gsize len;
+      guint32 offset;
+      time_t timestamp;
+      guint32 new_segment;
+      guint32 new_offset;
+      gboolean written;
+
+      if (!tile || tile->segment != id)
+        continue;
+
+      map = tile_store_view(priv, tile, &data, &len);
+      if (!map)
+      {
+        tile_index_unlink(priv, tile);
+        g_slice_free(NMProviderCachedTile, tile);
+        continue;
+      }
+
+      offset = tile->offset;
+      timestamp = tile->timestamp;
+      G_UNLOCK(tile_index);
+      written = tile_store_write(priv, key, timestamp, data, len,
+                                 &new_segment, &new_offset);
+      G_LOCK(tile_index);
+      tile_store_map_unref(map);
+
+      /* might have been evicted or replaced meanwhile */
+      tile = (NMProviderCachedTile *)
+          g_hash_table_lookup(priv->tile_index, &key);
+
+      if (written && tile && tile->segment == id && tile->offset == offset &&
+          g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(new_segment)))
+      {
+        NMProviderSegment *from = (NMProviderSegment *)
+            g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(id));
+        NMProviderSegment *to = (NMProviderSegment *)
+            g_hash_table_lookup(priv->segments,
+                                GUINT_TO_POINTER(new_segment));
+
+        from->live -= tile->size;
+        to->live += tile->size;
+        tile->segment = new_segment;
+        tile->offset = new_offset;
+        priv->tile_index_dirty = TRUE;
+      }
+    }
+
+    g_array_free(keys, TRUE);
+
+    seg = (NMProviderSegment *)
+        g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(id));
+
+    if (seg && !seg->live)
+    {
+      gchar *filename = tile_store_segment_filename(priv, id);
+
+      tile_store_segment_free(priv, seg);
+      G_UNLOCK(tile_index);
+
+      if (g_unlink(filename))
+        g_warning("Could not remove %s from the cache", filename);
+
+      g_free(filename);
+      G_LOCK(tile_index);
+    }
+  }
+
+  g_slist_free(segments);
+}
+
+/* Keeps the disk cache within cache_max_size/cache_max_files by removing the
+   least recently used tiles, and compacts the packed store. Runs in its own
+   thread, so requests never wait for the unlinks. */
+static gpointer tile_cache_evict_thread(NMProviderPrivate *priv)
+{
+  GMutex *mutex = g_static_mutex_get_mutex(&G_LOCK_NAME(tile_index));
+
+  G_LOCK(tile_index);
+
+  while (1)
+  {
+    GSList *evicted = NULL;
+    GSList *l;
+
+    /* segments can't be compacted before all their tiles are known */
+    while (!tile_cache_over_quota(priv, 100) &&
+           !(priv->tile_store_compact && priv->tile_index_loaded))
+    {
+      g_cond_wait(priv->evict_cond, mutex);
+    }
+
+    while (tile_cache_over_quota(priv, TILE_CACHE_LOW_WATERMARK) &&
+           !g_queue_is_empty(&priv->tile_lru))
+    {
+      NMProviderCachedTile *tile = (NMProviderCachedTile *)
+          g_queue_peek_tail_link(&priv->tile_lru)->data;
+
+      tile_index_unlink(priv, tile);
+      evicted = g_slist_prepend(evicted, tile);
+    }
+
+    G_UNLOCK(tile_index);
+
+    for (l = evicted; l; l = l->next)
+    {
+      NMProviderCachedTile *tile = (NMProviderCachedTile *)l->data;
+      gchar *filename;
+
+      /* downloaded again meanwhile, packed tiles go away on compaction */
+      G_LOCK(tile_index);
+      if (g_hash_table_lookup(priv->tile_index, &tile->key) ||
+          tile->segment != TILE_NO_SEGMENT)
+      {
+        filename = NULL;
+      }
+      else
+        filename = tile_cache_filename(priv, tile->key);
+      G_UNLOCK(tile_index);
+
+      if (filename && g_unlink(filename))
+        g_warning("Could not remove %s from the cache", filename);
+
+      g_free(filename);
+      g_slice_free(NMProviderCachedTile, tile);
+    }
+
+    g_slist_free(evicted);
+
+    G_LOCK(tile_index);
+
+    /* evicting packed tiles only makes them dead */
+    if (tile_store_over_quota(priv))
+    {
+      priv->tile_store_compact = TRUE;
+      priv->tile_store_compact_all = TRUE;
+    }
+
+    if (priv->tile_store_compact && priv->tile_index_loaded)
+      tile_store_compact(priv);
+  }
+
+  return NULL;
+}
+
+static void tile_index_add(NMProviderPrivate *priv, guint64 key,
+                           time_t timestamp, gsize size)
+{
+  NMProviderCachedTile *tile = g_slice_new(NMProviderCachedTile);
+
+  tile->key = key;
+  tile->timestamp = timestamp;
+  tile->size = size;
+  tile->segment = TILE_NO_SEGMENT;
+  tile->offset = 0;
+
+  G_LOCK(tile_index);
+  tile_index_insert(priv, tile);
+  G_UNLOCK(tile_index);
+}
+
+static gchar *tile_index_filename(NMProviderPrivate *priv)
+{
+  return g_strdup_printf("%s/%s", priv->cache_dir,
+                         priv->packed_cache ?
+                           TILE_STORE_INDEX_FILE : TILE_INDEX_FILE);
+}
+
+/* The index is saved to TILE_INDEX_FILE (TILE_STORE_INDEX_FILE for the
+   packed store) in the cache directory on exit and every
+   TILE_INDEX_SAVE_INTERVAL seconds if it changed, so on the next start it can
+   be loaded instead of stat()-ing every tile. Tiles are stored most recently
+   used first. */
+static gboolean tile_index_save(NMProviderPrivate *priv)
+{
+  NMProviderTileIndexHeader *header;
+  NMProviderTileRecord *record;
+  gchar *buf;
+  gchar *filename;
+  gsize len;
+  GList *l;
+  gboolean rv;
+
+  G_LOCK(tile_index);
+
+  if (!priv->tile_index_loaded)
+  {
+    /* would lose what is not loaded yet */
+    G_UNLOCK(tile_index);
+    return FALSE;
+  }
+
+  len = sizeof(NMProviderTileIndexHeader) +
+      g_hash_table_size(priv->tile_index) * sizeof(NMProviderTileRecord);
+  buf = (gchar *)g_malloc(len);
+  header = (NMProviderTileIndexHeader *)buf;
+  header->magic = TILE_INDEX_MAGIC;
+  header->version = TILE_INDEX_VERSION;
+  header->count = g_hash_table_size(priv->tile_index);
+  header->next_segment = priv->next_segment;
+  record = (NMProviderTileRecord *)(header + 1);
+
+  for (l = g_queue_peek_head_link(&priv->tile_lru); l; l = l->next, record ++)
+  {
+    NMProviderCachedTile *tile = (NMProviderCachedTile *)l->data;
+
+    record->key = tile->key;
+    record->timestamp = tile->timestamp;
+    record->size = tile->size;
+    record->segment = tile->segment;
+    record->offset = tile->offset;
+    record->reserved = 0;
+  }
+
+  priv->tile_index_dirty = FALSE;
+  G_UNLOCK(tile_index);
+
+  filename = tile_index_filename(priv);
+  rv = g_file_set_contents(filename, buf, len, NULL);
+  if (!rv)
+    g_warning("Could not save tile cache index to %s", filename);
+
+  g_free(filename);
+  g_free(buf);
+
+  return rv;
+}
+
+static gpointer tile_index_save_thread(NMProviderPrivate *priv)
+{
+  tile_index_save(priv);
+  g_atomic_int_set(&priv->tile_index_saving, FALSE);
+
+  return NULL;
+}
+
+/* called periodically from the main loop */
+static gboolean tile_index_save_timeout(NMProviderPrivate *priv)
+{
+  gboolean dirty;
+
+  G_LOCK(tile_index);
+  dirty = priv->tile_index_dirty && priv->tile_index_loaded;
+  G_UNLOCK(tile_index);
+
+  if (dirty &&
+      g_atomic_int_compare_and_exchange(&priv->tile_index_saving, FALSE, TRUE))
+  {
+    g_thread_create((GThreadFunc)tile_index_save_thread, priv, FALSE, NULL);
+  }
+
+  return TRUE;
+}
+
+/* Adds a tile found while loading the index, unless a request got it in
+   meanwhile. Loaded tiles are appended, as they are older than anything the
+   requests touched already. Must be called with tile_index locked. */
+static void tile_index_append(NMProviderPrivate *priv,
+                              const NMProviderTileRecord *record)
+{
+  NMProviderCachedTile *tile;
+
+  if (g_hash_table_lookup(priv->tile_index, &record->key))
+    return;
+
+  /* tiles from the other kind of store, or from a segment which is gone, are
+     ignored */
+  if (priv->packed_cache ?
+        !tile_store_segment_open(priv, record->segment) :
+        record->segment != TILE_NO_SEGMENT)
+  {
+    return;
+  }
+
+  tile = g_slice_new(NMProviderCachedTile);
+  tile->key = record->key;
+  tile->timestamp = record->timestamp;
+  tile->size = record->size;
+  tile->segment = record->segment;
+  tile->offset = record->offset;
+  tile_index_link(priv, tile, FALSE);
+}
+
+static void tile_index_append_records(NMProviderPrivate *priv,
+                                      const NMProviderTileRecord *records,
+                                      guint count)
+{
+  guint i;
+
+  for (i = 0; i < count; i += TILE_INDEX_LOAD_BATCH)
+  {
+    guint j;
+
+    G_LOCK(tile_index);
+
+    for (j = i; j < count && j < i + TILE_INDEX_LOAD_BATCH; j ++)
+      tile_index_append(priv, &records[j]);
+
+    G_UNLOCK(tile_index);
+  }
+}
+
+/* mtime is set to when the snapshot was written */
+static gboolean tile_index_load_snapshot(NMProviderPrivate *priv,
+                                         time_t *mtime)
+{
+  GMappedFile *mapped;
+  const NMProviderTileIndexHeader *header;
+  gchar *filename;
+  struct stat st;
+  gsize len;
+
+  filename = tile_index_filename(priv);
+  mapped = stat(filename, &st) ? NULL :
+                                 g_mapped_file_new(filename, FALSE, NULL);
+  g_free(filename);
+
+  if (!mapped)
+    return FALSE;
+
+  *mtime = st.st_mtim.tv_sec;
+
+  len = g_mapped_file_get_length(mapped);
+  header = (const NMProviderTileIndexHeader *)g_mapped_file_get_contents(mapped);
+
+  if (len < sizeof(NMProviderTileIndexHeader) ||
+      header->magic != TILE_INDEX_MAGIC ||
+      header->version != TILE_INDEX_VERSION ||
+      /* the multiplication below must not overflow */
+      header->count > (len - sizeof(NMProviderTileIndexHeader)) /
+      sizeof(NMProviderTileRecord) ||
+      len != sizeof(NMProviderTileIndexHeader) +
+      header->count * sizeof(NMProviderTileRecord))
+  {
+    g_warning("Tile cache index is invalid, rebuilding it");
+    g_mapped_file_free(mapped);
+    return FALSE;
+  }
+
+  G_LOCK(tile_index);
+  if (header->next_segment > priv->next_segment)
+    priv->next_segment = header->next_segment;
+  G_UNLOCK(tile_index);
+
+  tile_index_append_records(priv, (const NMProviderTileRecord *)(header + 1),
+                            header->count);
+  g_mapped_file_free(mapped);
+
+  return TRUE;
+}
+
+/* Adds all the records found in the segment to tiles, stops at the first
+   broken one, as that is where writing it was interrupted */
+static void tile_store_scan_segment(NMProviderPrivate *priv, guint id,
+                                    GArray *tiles)
+{
+  gchar *filename = tile_store_segment_filename(priv, id);
+  GMappedFile *mapped = g_mapped_file_new(filename, FALSE, NULL);
+  const gchar *contents;
+  gsize offset;
+  gsize len;
+
+  g_free(filename);
+
+  if (!mapped)
+    return;
+
+  len = g_mapped_file_get_length(mapped);
+  contents = g_mapped_file_get_contents(mapped);
+
+  G_LOCK(tile_index);
+  tile_store_segment_get(priv, id, len);
+  G_UNLOCK(tile_index);
+
+  for (offset = 0; offset + sizeof(NMProviderSegmentRecord) <= len; )
+  {
+    const NMProviderSegmentRecord *record =
+        (const NMProviderSegmentRecord *)(contents + offset);
+    NMProviderTileRecord tile;
+
+    if (record->magic != TILE_STORE_RECORD_MAGIC ||
+        offset + TILE_STORE_RECORD_SIZE(record->len) > len)
+    {
+      break;
+    }
+
+    tile.key = record->key;
+    tile.timestamp = record->timestamp;
+    tile.size = TILE_STORE_RECORD_SIZE(record->len);
+    tile.segment = id;
+    tile.offset = offset;
+    tile.reserved = 0;
+    g_array_append_val(tiles, tile);
+
+    offset += tile.size;
+  }
+
+  g_mapped_file_free(mapped);
+}
+
+/* Moves the tiles from the one file per tile cache to the packed store */
+static void tile_store_import(NMProviderPrivate *priv, GArray *tiles)
+{
+  gchar *filename;
+  guint i;
+
+  g_array_sort(tiles, (GCompareFunc)compare_tiles);
+
+  for (i = 0; i < tiles->len; i ++)
+  {
+    NMProviderTileRecord record = g_array_index(tiles, NMProviderTileRecord, i);
+    gchar *data;
+    gsize len;
+
+    filename = tile_cache_filename(priv, record.key);
+
+    if (g_file_get_contents(filename, &data, &len, NULL))
+    {
+      if (tile_store_write(priv, record.key, record.timestamp,
+                           (const guchar *)data, len,
+                           &record.segment, &record.offset))
+      {
+        record.size = TILE_STORE_RECORD_SIZE(len);
+
+        G_LOCK(tile_index);
+        tile_index_append(priv, &record);
+        G_UNLOCK(tile_index);
+
+        g_unlink(filename);
+      }
+
+      g_free(data);
+    }
+
+    g_free(filename);
+  }
+
+  /* no longer valid */
+  filename = g_strdup_printf("%s/%s", priv->cache_dir, TILE_INDEX_FILE);
+  g_unlink(filename);
+  g_free(filename);
+}
+
+/* Indexes the files modified since the given time, all of them if it is 0.
+   Returns TRUE if any were found */
+static gboolean tile_index_scan(NMProviderPrivate *priv, time_t since)
+{
+  GArray *tiles;
+  GArray *loose;
+  GDir *dir;
+  gboolean found;
+
+  dir = g_dir_open(priv->cache_dir, 0, NULL);
+  if (!dir)
+  {
+    g_warning("Could not read files from cache");
+    return FALSE;
+  }
+
+  tiles = g_array_new(FALSE, FALSE, sizeof(NMProviderTileRecord));
+  /* the packed store imports the tile files */
+  loose = priv->packed_cache ?
+        g_array_new(FALSE, FALSE, sizeof(NMProviderTileRecord)) : tiles;
+
+  for ( ; ; )
+  {
+    const gchar *fname = g_dir_read_name(dir);
+    int zoom, x, y, mapoptions;
+    guint id;
+
+    if (!fname)
+      break;
+
+    if (strlen(fname) == 20 && g_str_has_suffix(fname, ".png") &&
+        sscanf(fname, "%2d%6d%6d%2d.png", &zoom, &x, &y, &mapoptions) == 4)
+    {
+      struct stat stat_buf;
+      gchar *pngfname = g_strdup_printf("%s/%s", priv->cache_dir, fname);
+
+      if (!stat(pngfname, &stat_buf) && stat_buf.st_mtim.tv_sec >= since)
+      {
+        NMProviderTileRecord record;
+
+        record.key = TILE_KEY(zoom, x, y, mapoptions);
+        record.timestamp = stat_buf.st_mtim.tv_sec;
+        record.size = stat_buf.st_size;
+        record.segment = TILE_NO_SEGMENT;
+        record.offset = 0;
+        record.reserved = 0;
+        g_array_append_val(loose, record);
+      }
+
+      g_free(pngfname);
+    }
+    else if (priv->packed_cache && g_str_has_suffix(fname, ".seg") &&
+             sscanf(fname, TILE_STORE_SEGMENT_FILE, &id) == 1)
+    {
+      gchar *segfname = g_strdup_printf("%s/%s", priv->cache_dir, fname);
+      struct stat stat_buf;
+
+      /* the tiles already indexed are skipped when appending */
+      if (!since ||
+          (!stat(segfname, &stat_buf) && stat_buf.st_mtim.tv_sec >= since))
+      {
+        tile_store_scan_segment(priv, id, tiles);
+      }
+
+      g_free(segfname);
+    }
+  }
+
+  g_dir_close(dir);
+  found = tiles->len || loose->len;
+
+  /* the same tile might be in more than one segment, the newest wins */
+  g_array_sort(tiles, (GCompareFunc)compare_tiles);
+  tile_index_append_records(priv, (const NMProviderTileRecord *)tiles->data,
+                            tiles->len);
+
+  if (loose != tiles)
+  {
+    tile_store_import(priv, loose);
+    g_array_free(loose, TRUE);
+  }
+
+  g_array_free(tiles, TRUE);
+
+  return found;
+}
+
+/* Loads the index in the background, requests are served meanwhile falling
+   back to stat() for the tiles not loaded yet */
+static gpointer tile_index_load_thread(NMProviderPrivate *priv)
+{
+  time_t mtime;
+  gboolean dirty;
+
+  /* the tiles written after the last snapshot (the provider might have been
+     killed before the next one) are picked up from the files */
+  if (tile_index_load_snapshot(priv, &mtime))
+    dirty = tile_index_scan(priv, mtime);
+  else
+  {
+    tile_index_scan(priv, 0);
+    dirty = TRUE;
+  }
+
+  G_LOCK(tile_index);
+  priv->tile_index_loaded = TRUE;
+  priv->tile_index_dirty = dirty;
+  /* now that the live tiles in every segment are known */
+  priv->tile_store_compact = priv->packed_cache;
+  g_cond_signal(priv->evict_cond);
+  G_UNLOCK(tile_index);
+
+  return NULL;
+}
+
+/* Returns the tile if it is in the index and fresh enough, must be called
+   with tile_index locked */
+static NMProviderCachedTile *tile_index_touch(NMProviderPrivate *priv,
+                                              guint64 key, time_t timer)
+{
+  NMProviderCachedTile *tile =
+      (NMProviderCachedTile *)g_hash_table_lookup(priv->tile_index, &key);
+
+  /* a hit alone doesn't make the index dirty, otherwise it would be saved
+     every TILE_INDEX_SAVE_INTERVAL while browsing cached tiles, the new
+     order is saved along with the next change or on exit */
+  if (tile && tile->timestamp > timer - 30 * 24 * 60 * 60)
+  {
+    g_queue_unlink(&priv->tile_lru, &tile->link);
+    g_queue_push_head_link(&priv->tile_lru, &tile->link);
+
+    return tile;
+  }
+
+  return NULL;
+}
+
+static gboolean tile_index_lookup(NMProviderPrivate *priv, guint64 key,
+                                  time_t *timestamp)
+{
+  NMProviderCachedTile *tile;
+  time_t timer;
+  gboolean rv = FALSE;
+
+  time(&timer);
+
+  G_LOCK(tile_index);
+  tile = tile_index_touch(priv, key, timer);
+
+  if (tile)
+  {
+    *timestamp = tile->timestamp;
+    rv = TRUE;
+  }
+  else if (!priv->tile_index_loaded && !priv->packed_cache &&
+           !g_hash_table_lookup(priv->tile_index, &key))
+  {
+    gchar *filename = tile_cache_filename(priv, key);
+    struct stat st;
+
+    /* still loading, it might be there anyway */
+    G_UNLOCK(tile_index);
+
+    if (!stat(filename, &st))
+    {
+      tile_index_add(priv, key, st.st_mtim.tv_sec, st.st_size);
+
+      if (st.st_mtim.tv_sec > timer - 30 * 24 * 60 * 60)
+      {
+        *timestamp = st.st_mtim.tv_sec;
+        rv = TRUE;
+      }
+    }
+
+    g_free(filename);
+
+    return rv;
+  }
+
+  G_UNLOCK(tile_index);
+
+  return rv;
 }
 
-static void navigation_location_to_address_reply(
-    NMProviderThreadData *thread_data,
-    gboolean verbose)
+/* Returns a view of the tile data in the packed store if it is there and
+   fresh enough, to be released with tile_store_view_release() */
+static NMProviderSegmentMap *tile_store_lookup(NMProviderPrivate *priv,
+                                               guint64 key, time_t *timestamp,
+                                               const guchar **data, gsize *len)
 {
-  NavigationLocation *location;
-  DBusMessage *message;
-  NMProviderLocation *provider_location;
-  NMProviderPrivate *priv;
-  GHashTable *hash_table = thread_data->provider->priv->loc_hash_table;
-  DBusMessageIter sub;
-  DBusMessageIter iter;
+  NMProviderCachedTile *tile;
+  NMProviderSegmentMap *map = NULL;
 
-  location = (NavigationLocation *)thread_data->data;
-  message = dbus_message_new_signal(thread_data->responce,
-                                    "com.nokia.Navigation.MapProvider",
-                                    "LocationToAddressReply");
-  if (!message)
+  G_LOCK(tile_index);
+  tile = tile_index_touch(priv, key, time(NULL));
+
+  if (tile)
+  {
+    map = tile_store_view(priv, tile, data, len);
+    *timestamp = tile->timestamp;
+  }
+
+  G_UNLOCK(tile_index);
+
+  return map;
+}
+
+static void tile_index_remove(NMProviderPrivate *priv, guint64 key)
+{
+  NMProviderCachedTile *tile;
+
+  G_LOCK(tile_index);
+  tile = (NMProviderCachedTile *)g_hash_table_lookup(priv->tile_index, &key);
+
+  if (tile)
+  {
+    tile_index_unlink(priv, tile);
+    g_slice_free(NMProviderCachedTile, tile);
+  }
+
+  G_UNLOCK(tile_index);
+}
+
+/* The tile is stored as downloaded, g_file_set_contents() writes it to a
+   temporary file first and renames it, so readers never see partial tiles.
+   The packed store appends it to the current segment instead. */
+static void save_tile_to_cache(NMProviderPrivate *priv, guint64 key,
+                               const GByteArray *data, gchar *filename)
+{
+  if (priv->packed_cache)
+  {
+    NMProviderCachedTile *tile;
+    gboolean loaded;
+
+    G_LOCK(tile_index);
+    loaded = priv->tile_index_loaded;
+    G_UNLOCK(tile_index);
+
+    /* it might be in a segment not indexed yet, don't store it twice */
+    if (!loaded)
+      return;
+
+    tile = g_slice_new(NMProviderCachedTile);
+
+    tile->key = key;
+    tile->timestamp = time(NULL);
+    tile->size = TILE_STORE_RECORD_SIZE(data->len);
+
+    if (tile_store_write(priv, key, tile->timestamp, data->data, data->len,
+                         &tile->segment, &tile->offset))
+    {
+      G_LOCK(tile_index);
+
+      /* unless compacted away already */
+      if (g_hash_table_lookup(priv->segments, GUINT_TO_POINTER(tile->segment)))
+      {
+        tile_index_insert(priv, tile);
+        tile = NULL;
+      }
+
+      G_UNLOCK(tile_index);
+    }
+
+    if (tile)
+      g_slice_free(NMProviderCachedTile, tile);
+  }
+  else if (g_file_set_contents(filename, (const gchar *)data->data, data->len,
+                               NULL))
+  {
+    tile_index_add(priv, key, time(NULL), data->len);
+  }
+  else
+    g_warning("Saving tile to cache failed: %s\n", filename);
+}
+
+static gchar *map_tile_name_suffix(GetMapTileParams *tile_params)
+{
+  gchar *tile_type;
+  gchar *name_suffix;
+
+  switch (tile_params->mapoptions & 0x1C)
+  {
+    case 4:
+      tile_type = g_strdup("normal");
+      break;
+    case 8:
+    case 0xC:
+      tile_type = g_strdup("satellite");
+      break;
+    case 0x10:
+      tile_type = g_strdup("terrain");
+      break;
+    default:
+      tile_params->mapoptions |= 4;
+      tile_type = g_strdup("normal");
+      break;
+  }
+
+  if ((tile_params->mapoptions & 3) == 2)
+    name_suffix = g_strconcat(tile_type, ".night", NULL);
+  else
+  {
+    name_suffix = g_strconcat(tile_type, ".day", NULL);
+    tile_params->mapoptions |= 1;
+  }
+
+  g_free(tile_type);
+
+  return name_suffix;
+}
+
+static void map_view_init(NMProviderMapView *view,
+                          const GetMapTileParams *tile_params)
+{
+  view->size = pow(2, tile_params->zoom);
+  view->xia = (tile_params->width / 2) / (double)TILE_SIZE;
+  view->yia = (tile_params->height / 2) / (double)TILE_SIZE;
+  view->x = long2x(tile_params->longitude) * view->size;
+  view->y = lat2y(tile_params->latitude) * view->size;
+  view->pixleft = ((view->x - view->xia) - (int)(view->x - view->xia)) *
+      TILE_SIZE;
+  view->pixtop = ((view->y - view->yia) - (int)(view->y - view->yia)) *
+      TILE_SIZE;
+  view->cols = roundup256(view->pixleft + tile_params->width) / TILE_SIZE;
+  view->rows = roundup256(view->pixtop + tile_params->height) / TILE_SIZE;
+}
+
+static void map_tile_init(NMProviderPrivate *priv, NMProviderTile *tile,
+                          const GetMapTileParams *tile_params,
+                          const gchar *name_suffix, int x, int y)
+{
+  tile->zoom = tile_params->zoom;
+  tile->x = x;
+  tile->y = y;
+  tile->mapoptions = tile_params->mapoptions & MAP_TILE_OPTIONS;
+  tile->key = TILE_KEY(tile->zoom, tile->x, tile->y, tile->mapoptions);
+  tile->pixbuf = NULL;
+  tile->filename = tile_cache_filename(priv, tile->key);
+  tile->url = g_strdup_printf(
+        "%s/%s/%d/%d/%d/%d/%s?token=%s",
+        "http://maptile.maps.svc.ovi.com/maptiler/maptile/newest",
+        name_suffix,
+        tile->zoom,
+        tile->x,
+        tile->y,
+        256,
+        "png8",
+        "9b87b24dffafdfcb6dfc66eeba834caa");
+}
+
+static void map_tile_clear(NMProviderTile *tile)
+{
+  if (tile->pixbuf)
+    g_object_unref(tile->pixbuf);
+
+  g_free(tile->filename);
+  g_free(tile->url);
+}
+
+static void mem_tile_free(NMProviderMemTile *mem_tile)
+{
+  g_object_unref(mem_tile->pixbuf);
+  g_slice_free(NMProviderMemTile, mem_tile);
+}
+
+/* Returns a new reference to the decoded tile, or NULL */
+static GdkPixbuf *mem_tile_lookup(NMProviderPrivate *priv, guint64 key)
+{
+  NMProviderMemTile *mem_tile;
+  GdkPixbuf *pixbuf = NULL;
+  time_t timer;
+
+  time(&timer);
+
+  G_LOCK(mem_tiles);
+  mem_tile = (NMProviderMemTile *)g_hash_table_lookup(priv->mem_tiles, &key);
+
+  if (mem_tile && mem_tile->timestamp > timer - 30 * 24 * 60 * 60)
+  {
+    g_queue_unlink(&priv->mem_tiles_lru, &mem_tile->link);
+    g_queue_push_head_link(&priv->mem_tiles_lru, &mem_tile->link);
+    pixbuf = (GdkPixbuf *)g_object_ref(mem_tile->pixbuf);
+    priv->mem_tiles_hits ++;
+  }
+  else
+    priv->mem_tiles_misses ++;
+
+  G_UNLOCK(mem_tiles);
+
+  return pixbuf;
+}
+
+static void mem_tile_remove(NMProviderPrivate *priv,
+                            NMProviderMemTile *mem_tile)
+{
+  g_queue_unlink(&priv->mem_tiles_lru, &mem_tile->link);
+  g_hash_table_remove(priv->mem_tiles, &mem_tile->key);
+  priv->mem_tiles_size -= mem_tile->size;
+  mem_tile_free(mem_tile);
+}
+
+/* timestamp is when the tile was downloaded */
+static void mem_tile_insert(NMProviderPrivate *priv, guint64 key,
+                            GdkPixbuf *pixbuf, time_t timestamp)
+{
+  NMProviderMemTile *mem_tile;
+  NMProviderMemTile *old;
+
+  if (!pixbuf)
     return;
 
-  dbus_message_iter_init_append(message, &iter);
-  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "as", &sub);
+  mem_tile = g_slice_new(NMProviderMemTile);
+  mem_tile->key = key;
+  mem_tile->pixbuf = (GdkPixbuf *)g_object_ref(pixbuf);
+  mem_tile->size = gdk_pixbuf_get_rowstride(pixbuf) *
+      gdk_pixbuf_get_height(pixbuf);
+  mem_tile->timestamp = timestamp;
+  mem_tile->link.data = mem_tile;
+  mem_tile->link.prev = mem_tile->link.next = NULL;
 
-  G_LOCK(hash_table);
-  provider_location =
-      (NMProviderLocation *)g_hash_table_lookup(hash_table, location);
-  G_UNLOCK(hash_table);
+  G_LOCK(mem_tiles);
 
-  if (provider_location)
+  if (mem_tile->size > priv->mem_tiles_max_size)
   {
-    append_dbus_location_data(&sub, provider_location->navigation_data);
-    dbus_message_iter_close_container(&iter, &sub);
-    provider_location->ref_cnt ++;
+    G_UNLOCK(mem_tiles);
+    mem_tile_free(mem_tile);
+    return;
+  }
+
+  old = (NMProviderMemTile *)g_hash_table_lookup(priv->mem_tiles, &key);
+  if (old)
+    mem_tile_remove(priv, old);
+
+  g_hash_table_insert(priv->mem_tiles, &mem_tile->key, mem_tile);
+  g_queue_push_head_link(&priv->mem_tiles_lru, &mem_tile->link);
+  priv->mem_tiles_size += mem_tile->size;
+
+  while (priv->mem_tiles_size > priv->mem_tiles_max_size)
+  {
+    GList *last = g_queue_peek_tail_link(&priv->mem_tiles_lru);
+
+    mem_tile_remove(priv, (NMProviderMemTile *)last->data);
+  }
+
+  G_UNLOCK(mem_tiles);
+}
+
+/* Returns TRUE if the tile was found in the cache and is fresh enough */
+static gboolean map_tile_load_cached(NMProviderPrivate *priv,
+                                     NMProviderTile *tile)
+{
+  time_t timestamp;
+
+  tile->pixbuf = mem_tile_lookup(priv, tile->key);
+  if (tile->pixbuf)
+    return TRUE;
+
+  if (priv->packed_cache)
+  {
+    const guchar *data;
+    gsize len;
+    NMProviderSegmentMap *map =
+        tile_store_lookup(priv, tile->key, &timestamp, &data, &len);
+
+    if (!map)
+      return FALSE;
+
+    /* decoded straight from the mapping */
+    tile->pixbuf = decode_tile(data, len);
+    tile_store_view_release(map);
+
+    if (tile->pixbuf)
+    {
+      mem_tile_insert(priv, tile->key, tile->pixbuf, timestamp);
+      return TRUE;
+    }
+
+    g_warning("Cached tile corrupted,reloading from server\n");
+    tile_index_remove(priv, tile->key);
+  }
+  else if (tile_index_lookup(priv, tile->key, &timestamp))
+  {
+    tile->pixbuf = gdk_pixbuf_new_from_file(tile->filename, NULL);
+
+    if (tile->pixbuf)
+    {
+      mem_tile_insert(priv, tile->key, tile->pixbuf, timestamp);
+      return TRUE;
+    }
+
+    g_warning("Cached tile corrupted,reloading from server\n");
+    tile_index_remove(priv, tile->key);
+  }
+
+  return FALSE;
+}
+
+/* runs in the fetch pool */
+static void map_tile_download(NMProviderTile *tile, NMProviderPrivate *priv)
+{
+  /* overlapping composites often need the same edge tiles */
+  if (g_atomic_int_get(tile->cancelled))
+    return;
+
+  if (navigation_flight_begin(&priv->tile_flights, &tile->key,
+                              (gpointer *)&tile->pixbuf))
+  {
+    GByteArray *data = download_tile(priv, tile->url);
+
+    if (data)
+    {
+      tile->pixbuf = decode_tile(data->data, data->len);
+
+      /* don't let garbage in the cache */
+      if (tile->pixbuf)
+      {
+        save_tile_to_cache(priv, tile->key, data, tile->filename);
+        mem_tile_insert(priv, tile->key, tile->pixbuf, time(NULL));
+      }
+
+      g_byte_array_free(data, TRUE);
+    }
+
+    navigation_flight_end(&priv->tile_flights, &tile->key, tile->pixbuf);
+  }
+}
+
+/* Loads all the tiles, the ones missing from the cache are downloaded
+   concurrently (at most max_tile_downloads at a time). Downloads not yet
+   started are skipped once the request gets cancelled */
+static void map_tiles_load(NMProviderPrivate *priv, NMProviderTile *tiles,
+                           int count, const gint *cancelled)
+{
+  NMProviderFetchBatch *batch = navigation_fetch_batch_new();
+  int i;
+
+  for (i = 0; i < count && !g_atomic_int_get(cancelled); i ++)
+  {
+    tiles[i].cancelled = cancelled;
+
+    if (!map_tile_load_cached(priv, &tiles[i]))
+    {
+      navigation_fetch_batch_push(priv, batch, (GFunc)map_tile_download,
+                                  &tiles[i]);
+    }
+  }
+
+  navigation_fetch_batch_wait(batch);
+}
+
+/* Copies a row of pixels, adding or dropping the alpha channel if needed */
+static void map_blit_row(guchar *dest, int dest_channels, const guchar *src,
+                         int src_channels, int width)
+{
+  int i;
+
+  if (dest_channels == src_channels)
+  {
+    memcpy(dest, src, width * dest_channels);
+    return;
+  }
+
+  for (i = 0; i < width; i ++, dest += dest_channels, src += src_channels)
+  {
+    dest[0] = src[0];
+    dest[1] = src[1];
+    dest[2] = src[2];
+
+    if (dest_channels == 4)
+      dest[3] = 0xFF;
+  }
+}
+
+/* Composites the tiles of the view, grid holds them column by column. Only
+   the visible part of every tile is copied, straight to a pixbuf of the
+   requested size. It has an alpha channel only for the default format, the
+   clients of which expect RGBA. Returns NULL if any of the tiles is
+   missing */
+static GdkPixbuf *map_view_render(const NMProviderMapView *view,
+                                  const GetMapTileParams *tile_params,
+                                  NMProviderTile **grid)
+{
+  gboolean alpha =
+      (tile_params->mapoptions & MAP_OPTION_FORMAT) == MAP_FORMAT_PIXDATA;
+  GdkPixbuf *pixbuf;
+  guchar *pixels;
+  int rowstride;
+  int channels;
+  int col, row;
+
+  pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, alpha, 8, tile_params->width,
+                          tile_params->height);
+  if (!pixbuf)
+    return NULL;
+
+  pixels = gdk_pixbuf_get_pixels(pixbuf);
+  rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+  channels = gdk_pixbuf_get_n_channels(pixbuf);
+
+  for (col = 0; col < view->cols; col ++)
+  {
+    for (row = 0; row < view->rows; row ++)
+    {
+      NMProviderTile *tile = grid[col * view->rows + row];
+      /* where the tile is in the output, it might start above or left of it */
+      int left = col * TILE_SIZE - view->pixleft;
+      int top = row * TILE_SIZE - view->pixtop;
+      int x0, y0, x1, y1, y;
+      const guchar *src;
+      int src_rowstride;
+      int src_channels;
+
+      if (!tile->pixbuf)
+      {
+        g_warning("Could not get map tile");
+        g_object_unref(pixbuf);
+        return NULL;
+      }
+
+      x0 = MAX(left, 0);
+      y0 = MAX(top, 0);
+      x1 = MIN(left + gdk_pixbuf_get_width(tile->pixbuf), tile_params->width);
+      y1 = MIN(top + gdk_pixbuf_get_height(tile->pixbuf),
+               tile_params->height);
+
+      if (x0 >= x1 || y0 >= y1)
+        continue;
+
+      src = gdk_pixbuf_get_pixels(tile->pixbuf);
+      src_rowstride = gdk_pixbuf_get_rowstride(tile->pixbuf);
+      src_channels = gdk_pixbuf_get_n_channels(tile->pixbuf);
+
+      for (y = y0; y < y1; y ++)
+      {
+        map_blit_row(pixels + y * rowstride + x0 * channels, channels,
+                     src + (y - top) * src_rowstride + (x0 - left) *
+                     src_channels, src_channels, x1 - x0);
+      }
+    }
+  }
+
+  return pixbuf;
+}
+
+/* Appends the nw and se corners of the view */
+static void map_view_append_corners(DBusMessageIter *array,
+                                    const NMProviderMapView *view)
+{
+  double nwlat = y2lat(view->y - view->yia, view->size);
+  double nwlong = x2long(view->x - view->xia, view->size);
+  double selat = y2lat(view->y + view->yia, view->size);
+  double selong = x2long(view->x + view->xia, view->size);
+  DBusMessageIter elem;
+
+  dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL, &elem);
+  dbus_message_iter_append_basic(&elem, DBUS_TYPE_DOUBLE, &nwlat);
+  dbus_message_iter_append_basic(&elem, DBUS_TYPE_DOUBLE, &nwlong);
+  dbus_message_iter_close_container(array, &elem);
+
+  dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL, &elem);
+  dbus_message_iter_append_basic(&elem, DBUS_TYPE_DOUBLE, &selat);
+  dbus_message_iter_append_basic(&elem, DBUS_TYPE_DOUBLE, &selong);
+  dbus_message_iter_close_container(array, &elem);
+}
+
+/* bytes per row of the pixbuf in a raw format */
+static guint map_format_stride(GdkPixbuf *pixbuf, guint format)
+{
+  int width = gdk_pixbuf_get_width(pixbuf);
+
+  switch (format)
+  {
+    case MAP_FORMAT_RGB565:
+      return width * 2;
+    case MAP_FORMAT_RGB:
+      return width * 3;
+    default:
+      return width * gdk_pixbuf_get_n_channels(pixbuf);
+  }
+}
+
+/* Converts a row of the pixbuf to a raw format */
+static void map_format_convert_row(const guchar *src, int n_channels,
+                                   int width, guint format, guint8 *dest)
+{
+  int i;
+
+  if (format == MAP_FORMAT_RGB565)
+  {
+    guint16 *pixel = (guint16 *)dest;
+
+    for (i = 0; i < width; i ++, src += n_channels)
+    {
+      pixel[i] = ((src[0] & 0xF8) << 8) | ((src[1] & 0xFC) << 3) |
+          (src[2] >> 3);
+    }
+  }
+  else if (format == MAP_FORMAT_RGB && n_channels != 3)
+  {
+    for (i = 0; i < width; i ++, src += n_channels, dest += 3)
+    {
+      dest[0] = src[0];
+      dest[1] = src[1];
+      dest[2] = src[2];
+    }
   }
   else
+    memcpy(dest, src, width * n_channels);
+}
+
+static guint8 *map_pixbuf_pixdata(GdkPixbuf *pixbuf, gsize *len)
+{
+  GdkPixdata pixdata;
+  guint8 *buffer;
+  guint size;
+
+  gdk_pixdata_from_pixbuf(&pixdata, pixbuf, FALSE);
+  buffer = gdk_pixdata_serialize(&pixdata, &size);
+  *len = size;
+
+  return buffer;
+}
+
+/* Encodes the composite in the format asked for with the mapoptions */
+static guint8 *map_pixbuf_encode(GdkPixbuf *pixbuf, guint format, gsize *len)
+{
+  const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+  int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+  int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+  int width = gdk_pixbuf_get_width(pixbuf);
+  int height = gdk_pixbuf_get_height(pixbuf);
+  int row;
+
+  switch (format)
   {
-    if (!g_atomic_int_get(&thread_data->provider->priv->con_ic_do_not_connect))
-    {
-      char lon[G_ASCII_DTOSTR_BUF_SIZE];
-      char lat[G_ASCII_DTOSTR_BUF_SIZE];
-      gchar *http_req;
-      xmlDoc *xml_doc;
-
-      priv = thread_data->provider->priv;
-      con_ic_connect(thread_data->provider->priv);
-      g_ascii_dtostr(lat, sizeof(lat), location->latitude);
-      g_ascii_dtostr(lon, sizeof(lon), location->longitude);
-      http_req = g_strdup_printf(
-            "%s/rgc/1.0?total=1&lat=%s&long=%s&token=%s",
-            priv->provider_url,
-            lat,
-            lon,
-            "9b87b24dffafdfcb6dfc66eeba834caa");
-
-      xml_doc = http_request_reply(http_req);
-      if (xml_doc)
+    case MAP_FORMAT_PNG:
+    {
+      gchar *buffer = NULL;
+      GError *error = NULL;
+
+      if (!gdk_pixbuf_save_to_buffer(pixbuf, &buffer, len, "png", &error,
+                                     NULL))
       {
-        xmlXPathContext *ctxt = xmlXPathNewContext(xml_doc);
+        g_warning("Could not encode map tile: %s", error->message);
+        g_error_free(error);
+        *len = 0;
+      }
 
-        if (ctxt)
-        {
-          NavigationAddress *address = NULL;
-          xmlXPathObject *path = get_path(ctxt,
-                                          "gc",
-                                          "nokia:geocoder:gc:1.0",
-                                          "/gc:places/gc:place/gc:address");
-
-          if (!path)
-            path = get_path(ctxt,
-                            "gc",
-                            "nokia:search:gc:1.0",
-                            "/gc:response/gc:place/gc:address");
-          if (path)
-          {
-            address =
-                (NavigationAddress *)g_malloc0(sizeof(NavigationAddress));
-            address->country = get_path_text("//gc:country", ctxt);
-            address->country_code = get_path_text("//gc:countryCode", ctxt);
-            address->suburb = get_path_text("//gc:district", ctxt);
-            address->town = get_path_text("//gc:city", ctxt);
-            address->postal_code = get_path_text("//gc:postCode", ctxt);
-            address->street = get_path_text("//gc:thoroughfare/gc:name", ctxt);
-            address->house_num =
-                get_path_text("//gc:thoroughfare/gc:number", ctxt);
-            xmlXPathFreeObject(path);
-
-            if (priv->provider_twn &&
-                g_strrstr_len(address->country, 6, "TAIWAN"))
-            {
-              g_free(address->country);
-              address->country = g_strdup("TAIWAN");
-            }
-          }
-          else
-            g_warning("Could not parse response");
-
-          xmlXPathFreeContext(ctxt);
-          xmlFreeDoc(xml_doc);
-          g_free(http_req);
-
-          if (address)
-          {
-            append_dbus_location_data(&sub, address);
-            dbus_message_iter_close_container(&iter, &sub);
-            provider_location =
-                (NMProviderLocation *)g_malloc0(sizeof(NMProviderLocation));
-            time(&provider_location->timestamp);
-            provider_location->navigation_data = address;
-            provider_location->ref_cnt = 1;
-
-            G_LOCK(hash_table);
-            g_hash_table_insert(hash_table,
-                                g_memdup(location, sizeof(NavigationLocation)),
-                                provider_location);
-            G_UNLOCK(hash_table);
-
-            goto send_reply;
-          }
-        }
-        else
-        {
-          g_warning("Could not create xpath context");
-          xmlFreeDoc(xml_doc);
-        }
+      return (guint8 *)buffer;
+    }
+    case MAP_FORMAT_RGB565:
+    {
+      NMProviderRGB565Header *header;
+      guint stride = map_format_stride(pixbuf, format);
+      guint8 *buffer;
+
+      *len = sizeof(NMProviderRGB565Header) + stride * height;
+      buffer = (guint8 *)g_malloc(*len);
+      header = (NMProviderRGB565Header *)buffer;
+      header->magic = MAP_RGB565_MAGIC;
+      header->width = width;
+      header->height = height;
+      header->stride = stride;
+
+      for (row = 0; row < height; row ++)
+      {
+        map_format_convert_row(pixels + row * rowstride, n_channels, width,
+                               format, buffer + sizeof(*header) + row * stride);
       }
-      else
-        g_warning("Could not connect to %s", http_req);
 
-      g_free(http_req);
+      return buffer;
     }
+    case MAP_FORMAT_RGB:
+    {
+      GdkPixbuf *rgb;
+      guint8 *buffer;
+
+      if (!gdk_pixbuf_get_has_alpha(pixbuf))
+        break;
+
+      rgb = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+
+      for (row = 0; row < height; row ++)
+      {
+        map_format_convert_row(pixels + row * rowstride, n_channels, width,
+                               format, gdk_pixbuf_get_pixels(rgb) +
+                               row * gdk_pixbuf_get_rowstride(rgb));
+      }
+
+      buffer = map_pixbuf_pixdata(rgb, len);
+      g_object_unref(rgb);
 
-    if (can_go_online(thread_data->provider->priv, verbose))
-      dbus_message_iter_close_container(&iter, &sub);
-    else
-    {
-      dbus_message_iter_close_container(&iter, &sub);
-      dbus_message_unref(message);
-      navigation_address_to_locations_error_reply(
-            thread_data->provider->priv->dbus,
-            thread_data->responce,
-            "LocationToAddressError");
-      return;
+      return buffer;
     }
   }
 
-send_reply:
-  dbus_connection_send(thread_data->provider->priv->dbus, message, 0);
-  dbus_message_unref(message);
-  return;
-
+  return map_pixbuf_pixdata(pixbuf, len);
 }
 
-static GdkPixbuf *download_tile(NMProviderPrivate *priv, const char *url)
+/* Appends the image and the corners of the view, the image is empty if
+   there is no pixbuf */
+static void map_view_append(DBusMessageIter *array,
+                            const NMProviderMapView *view,
+                            GdkPixbuf *pixbuf, guint format)
 {
-  GdkPixbuf *rv = NULL;
-  void *http_reply;
-  GdkPixbufLoader *loader;
-  guchar buffer[4096];
-  GError *error = NULL;
-  gchar *input = NULL;
+  DBusMessageIter elem;
+  guint8 *buffer = NULL;
+  gsize len = 0;
 
-  if (g_atomic_int_get(&priv->con_ic_do_not_connect))
-    return NULL;
+  if (pixbuf)
+    buffer = map_pixbuf_encode(pixbuf, format, &len);
 
-  con_ic_connect(priv);
-  xmlNanoHTTPInit();
+  dbus_message_iter_open_container(array, DBUS_TYPE_ARRAY,
+                                   DBUS_TYPE_BYTE_AS_STRING, &elem);
+  dbus_message_iter_append_fixed_array(&elem, DBUS_TYPE_BYTE, &buffer, len);
+  dbus_message_iter_close_container(array, &elem);
+  map_view_append_corners(array, view);
+
+  g_free(buffer);
+}
 
-  http_reply =
-      xmlNanoHTTPMethod(url, "GET", 0, &input, "Referer: Maemo_SW\n", 0);
-  if (!http_reply)
+#ifdef HAVE_MEMFD_REPLY
+/* Copies the pixels, rows packed and converted to the raw format, to a new
+   sealed memfd. Returns -1 if memfd or sealing is not supported by the
+   kernel */
+static int map_pixbuf_to_memfd(GdkPixbuf *pixbuf, guint format, guint *stride)
+{
+  const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+  int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+  int height = gdk_pixbuf_get_height(pixbuf);
+  guint8 *buffer;
+  int fd;
+  int row;
+
+  fd = syscall(SYS_memfd_create, "nokiamaps-tile",
+               MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+
+  *stride = map_format_stride(pixbuf, format);
+  buffer = (guint8 *)g_malloc(*stride);
+
+  for (row = 0; row < height; row ++)
   {
-fail:
-    g_warning("Failed to download map tile: %s", url);
-    g_free(input);
-    xmlNanoHTTPClose(http_reply);
-    xmlNanoHTTPCleanup();
-    return NULL;
+    map_format_convert_row(pixels + row * rowstride,
+                           gdk_pixbuf_get_n_channels(pixbuf),
+                           gdk_pixbuf_get_width(pixbuf), format, buffer);
+
+    if (!tile_store_write_all(fd, (const gchar *)buffer, *stride))
+    {
+      g_warning("Could not write map tile to memfd: %s", g_strerror(errno));
+      g_free(buffer);
+      close(fd);
+      return -1;
+    }
   }
 
-  if (xmlNanoHTTPReturnCode(http_reply) != 200)
+  g_free(buffer);
+
+  /* receivers can map it without worrying about it changing underneath */
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
   {
-    g_warning("HTTP return code: %d", xmlNanoHTTPReturnCode(http_reply));
-    goto fail;
+    g_warning("Could not seal map tile memfd: %s", g_strerror(errno));
+    close(fd);
+    return -1;
   }
 
-  loader = gdk_pixbuf_loader_new();
+  return fd;
+}
+
+/* Sends the composite as (fd, width, height, stride, nw, se) instead of a
+   serialized pixdata. The pixels are RGBA unless MAP_FORMAT_RGB or
+   MAP_FORMAT_RGB565 is asked for. Only the client which asked for it with
+   MAP_OPTION_FD_REPLY is known to accept fds, so the reply goes to it alone,
+   even if replies are broadcast otherwise. Returns FALSE if fd passing is
+   not possible, the caller falls back to GetMapTileReply then */
+static gboolean map_view_send_fd(NMProviderThreadData *thread_data,
+                                 const NMProviderMapView *view,
+                                 GdkPixbuf *pixbuf, guint format)
+{
+  NMProviderPrivate *priv = thread_data->provider->priv;
+  DBusMessage *message;
+  DBusMessageIter array;
+  guint width = gdk_pixbuf_get_width(pixbuf);
+  guint height = gdk_pixbuf_get_height(pixbuf);
+  guint stride;
+  int fd;
+
+  /* a PNG is small enough to go through the bus */
+  if (format == MAP_FORMAT_PNG || !thread_data->sender ||
+      !dbus_connection_can_send_type(priv->dbus, DBUS_TYPE_UNIX_FD))
+    return FALSE;
+
+  fd = map_pixbuf_to_memfd(pixbuf, format, &stride);
+  if (fd < 0)
+    return FALSE;
 
-  while ( 1 )
+  message = navigation_reply_new(thread_data, "GetMapTileFdReply");
+  if (message)
   {
-    int len = xmlNanoHTTPRead(http_reply, buffer, sizeof(buffer));
-    if ( len <= 0 )
-      break;
+    dbus_message_set_destination(message, thread_data->sender);
+
+    /* the message holds its own duplicate of the fd */
+    dbus_message_iter_init_append(message, &array);
+    dbus_message_iter_append_basic(&array, DBUS_TYPE_UNIX_FD, &fd);
+    dbus_message_iter_append_basic(&array, DBUS_TYPE_UINT32, &width);
+    dbus_message_iter_append_basic(&array, DBUS_TYPE_UINT32, &height);
+    dbus_message_iter_append_basic(&array, DBUS_TYPE_UINT32, &stride);
+    map_view_append_corners(&array, view);
+    dbus_connection_send(priv->dbus, message, NULL);
+    dbus_message_unref(message);
+  }
+
+  close(fd);
+
+  return TRUE;
+}
+#endif
 
-    if (!gdk_pixbuf_loader_write(loader, buffer, len, &error))
+static void navigation_get_map_tile_reply(NMProviderThreadData *thread_data)
+{
+  NMProviderPrivate *priv = thread_data->provider->priv;
+  GetMapTileParams* tile_params = (GetMapTileParams *)thread_data->data;
+  NMProviderMapView view;
+  NMProviderTile *tiles;
+  NMProviderTile **grid;
+  GdkPixbuf *pixbuf;
+  DBusMessage *message;
+  DBusMessageIter array;
+  gchar *name_suffix;
+  gboolean cancelled;
+  int col, row;
+
+  name_suffix = map_tile_name_suffix(tile_params);
+  map_view_init(&view, tile_params);
+
+  tiles = g_new(NMProviderTile, view.cols * view.rows);
+  grid = g_new(NMProviderTile *, view.cols * view.rows);
+
+  for (col = 0; col < view.cols; col ++)
+  {
+    for (row = 0; row < view.rows; row ++)
     {
-      g_warning("Error loading map tile: %s\n", error->message);
-      /* g_error_free was missing, yet another possible leak :( */
-      g_error_free(error);
-      break;
+      grid[col * view.rows + row] = &tiles[col * view.rows + row];
+      map_tile_init(priv, &tiles[col * view.rows + row], tile_params,
+                    name_suffix, view.x - view.xia + col,
+                    view.y - view.yia + row);
     }
   }
 
-  if (gdk_pixbuf_loader_close(loader, NULL))
-    rv = (GdkPixbuf *)g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+  g_free(name_suffix);
 
-  g_free(input);
-  xmlNanoHTTPClose(http_reply);
-  xmlNanoHTTPCleanup();
+  map_tiles_load(priv, tiles, view.cols * view.rows, &thread_data->cancelled);
 
-  if (loader)
-    g_object_unref(G_OBJECT(loader));
+  /* checked once, the pixbuf would leak if it got cancelled after rendering */
+  cancelled = navigation_request_cancelled(thread_data);
 
-  return rv;
-}
+  if (cancelled)
+    pixbuf = NULL;
+  else
+    pixbuf = map_view_render(&view, tile_params, grid);
 
-#define long2x(lon) ((lon + 180.0) / 360.0)
-#define deg2rad(deg) deg * M_PI / 180
+  for (col = 0; col < view.cols * view.rows; col ++)
+    map_tile_clear(&tiles[col]);
 
-static double lat2y(double lat)
-{
-  lat = deg2rad(lat);
-  double y = log(tan(lat) + (1/cos(lat)));
+  g_free(grid);
+  g_free(tiles);
 
-  return (M_PI- y) / (2 * M_PI);
-}
+  if (cancelled)
+    return;
 
-double y2lat(double y, double n)
-{
-  return
-      (atan(exp((2.0 * (1.0 - y / n) - 1.0) * M_PI)) - M_PI/4) * 360.0 / M_PI;
-}
+#ifdef HAVE_MEMFD_REPLY
+  if (pixbuf && (tile_params->mapoptions & MAP_OPTION_FD_REPLY) &&
+      map_view_send_fd(thread_data, &view, pixbuf,
+                       tile_params->mapoptions & MAP_OPTION_FORMAT))
+  {
+    g_object_unref(pixbuf);
+    return;
+  }
+#endif
 
-double x2long(double x, double n)
-{
-  return ((2 * x / n) - 1.0) * 180.0;
-}
+  message = navigation_reply_new(thread_data, "GetMapTileReply");
+  if (message)
+  {
+    dbus_message_iter_init_append(message, &array);
 
-inline static int roundup256(int n)
-{
- int r = n % 256;
- return r ? n + 256 - r : n;
+    if(pixbuf)
+    {
+      map_view_append(&array, &view, pixbuf,
+                      tile_params->mapoptions & MAP_OPTION_FORMAT);
+    }
+
+    dbus_connection_send(priv->dbus, message, NULL);
+    dbus_message_unref(message);
+  }
+
+  if(pixbuf)
+    g_object_unref(pixbuf);
 }
 
-static void add_tile_to_list(NMProviderPrivate *priv, gchar *filename)
+/* The tiles shared by the viewports are loaded only once, the composites are
+   sent in one reply, with an empty image for the ones that failed */
+static void navigation_get_map_tiles_reply(NMProviderThreadData *thread_data)
 {
-  GSList *tile_list;
-  NMProviderCachedTile *tile;
-  time_t timer;
+  NMProviderPrivate *priv = thread_data->provider->priv;
+  NMProviderMapTilesParams *params =
+      (NMProviderMapTilesParams *)thread_data->data;
+  NMProviderMapView *views;
+  NMProviderTile *tiles;
+  NMProviderTile **grid;
+  GHashTable *unique;
+  DBusMessage *message = NULL;
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  int total = 0;
+  int count = 0;
+  int n = 0;
+  guint i;
 
-  tile_list = priv->tile_list;
-  time(&timer);
+  views = g_new(NMProviderMapView, params->count);
 
-  if (tile_list)
+  for (i = 0; i < params->count; i ++)
   {
-    while (g_strcmp0(*(const char **)tile_list->data, filename))
-    {
-      tile_list = tile_list->next;
-      if (!tile_list)
-        break;
-    }
+    map_view_init(&views[i], &params->items[i]);
+    total += views[i].cols * views[i].rows;
+  }
+
+  tiles = g_new(NMProviderTile, total);
+  grid = g_new(NMProviderTile *, total);
+  unique = g_hash_table_new((GHashFunc)tile_key_hash,
+                            (GEqualFunc)tile_key_equal);
 
-    if (tile_list)
+  for (i = 0; i < params->count; i ++)
+  {
+    GetMapTileParams *item = &params->items[i];
+    gchar *name_suffix = map_tile_name_suffix(item);
+    int col, row;
+
+    for (col = 0; col < views[i].cols; col ++)
     {
-      tile = (NMProviderCachedTile *)tile_list->data;
-      tile->timestamp = timer;
-      return;
+      for (row = 0; row < views[i].rows; row ++)
+      {
+        int x = views[i].x - views[i].xia + col;
+        int y = views[i].y - views[i].yia + row;
+        guint64 key = TILE_KEY(item->zoom, x, y,
+                               item->mapoptions & MAP_TILE_OPTIONS);
+        NMProviderTile *tile =
+            (NMProviderTile *)g_hash_table_lookup(unique, &key);
+
+        if (!tile)
+        {
+          tile = &tiles[count ++];
+          map_tile_init(priv, tile, item, name_suffix, x, y);
+          g_hash_table_insert(unique, &tile->key, tile);
+        }
+
+        grid[n ++] = tile;
+      }
     }
+
+    g_free(name_suffix);
   }
 
-  tile = (NMProviderCachedTile *)g_malloc(sizeof(NMProviderCachedTile));
+  g_hash_table_destroy(unique);
 
-  tile->filename = g_strdup(filename);
-  tile->timestamp = timer;
-  priv->tile_list =
-      g_slist_insert_sorted(priv->tile_list, tile, (GCompareFunc)compare_tiles);
-}
+  map_tiles_load(priv, tiles, count, &thread_data->cancelled);
 
-static void save_tile_to_cache(NMProviderPrivate *priv,
-                               GdkPixbuf *pixbuf, gchar *filename)
-{
-  if (pixbuf)
+  if (!navigation_request_cancelled(thread_data))
   {
-    if (gdk_pixbuf_save(pixbuf, filename, "png", NULL, NULL))
-      add_tile_to_list(priv, filename);
-    else
-      g_warning("Saving tile to cache failed: %s\n", filename);
+    message = navigation_reply_new(thread_data, "GetMapTilesReply");
+  }
+
+  if (message)
+  {
+    dbus_message_iter_init_append(message, &iter);
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+                                     "(ay(dd)(dd))", &array);
+    n = 0;
+
+    for (i = 0; i < params->count; i ++)
+    {
+      GdkPixbuf *pixbuf = map_view_render(&views[i], &params->items[i],
+                                          &grid[n]);
+      DBusMessageIter item;
+
+      dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &item);
+      map_view_append(&item, &views[i], pixbuf,
+                      params->items[i].mapoptions & MAP_OPTION_FORMAT);
+      dbus_message_iter_close_container(&array, &item);
+      n += views[i].cols * views[i].rows;
+
+      if (pixbuf)
+        g_object_unref(pixbuf);
+    }
+
+    dbus_message_iter_close_container(&iter, &array);
+    dbus_connection_send(priv->dbus, message, NULL);
+    dbus_message_unref(message);
   }
+
+  for (n = 0; n < count; n ++)
+    map_tile_clear(&tiles[n]);
+
+  g_free(grid);
+  g_free(tiles);
+  g_free(views);
 }
 
 static void navigation_thread_func(NMProviderThreadData *thread_data,
                                    NMProviderPrivate *priv)
 {
   NMProviderThreadFunc func;
+  GTimeVal now;
+  glong wait;
+
+  g_atomic_int_inc(&priv->active_threads);
+
+  g_get_current_time(&now);
+  wait = (now.tv_sec - thread_data->queued.tv_sec) * 1000 +
+      (now.tv_usec - thread_data->queued.tv_usec) / 1000;
+  G_LOCK(thread_pool_stats);
+  priv->pool_wait_ms += MAX(wait, 0);
+  priv->pool_wait_count ++;
+  G_UNLOCK(thread_pool_stats);
 
   func = thread_data->func;
 
-  if (func == AddressToLocations || func == AddressToLocationsVerbose)
-  {
-    if (!g_atomic_int_get(&priv->con_ic_do_not_connect))
-      con_ic_connect(priv);
-  }
+  /* nobody is waiting for the reply anymore */
+  if (navigation_request_cancelled(thread_data))
+    goto done;
 
   switch (func)
   {
@@ -1403,210 +5982,22 @@ static void navigation_thread_func(NMProviderThreadData *thread_data,
       break;
     case LocationToAddress:
       navigation_location_to_address_reply(thread_data, 0);
-      remove_expired(priv);
       break;
     case LocationToAddressVerbose:
       navigation_location_to_address_reply(thread_data, 1);
-      remove_expired(priv);
       break;
-    case GetMapTile: {
-      GetMapTileParams* tile_params = (GetMapTileParams *)thread_data->data;
-      GdkPixbuf *tmp_pixbuf;
-      GdkPixbuf *pixbuf;
-      DBusMessage *message;
-      DBusMessageIter array;
-
-      const double tilesize = 256.0;
-      double size = pow(2, tile_params->zoom);
-      double xia = (tile_params->width / 2) / tilesize;
-      double yia = (tile_params->height / 2) / tilesize;
-      double x = long2x(tile_params->longitude) * size;
-      double y = lat2y(tile_params->latitude) * size;
-      double xi, yi, xoff, yoff;
-      int pixleft = ((x - xia) - (int)(x - xia)) * tilesize;
-      int pixtop = ((y - yia) - (int)(y - yia)) * tilesize;
-      int wtmp  = roundup256(pixleft + tile_params->width);
-      int htmp  = roundup256(pixtop + tile_params->height);
-
-      gchar *tile_type;
-      gchar *name_suffix;
-
-      switch (tile_params->mapoptions & 0x1C)
-      {
-        case 4:
-          tile_type = g_strdup("normal");
-          break;
-        case 8:
-        case 0xC:
-          tile_type = g_strdup("satellite");
-          break;
-        case 0x10:
-          tile_type = g_strdup("terrain");
-          break;
-        default:
-          tile_params->mapoptions |= 4;
-          tile_type = g_strdup("normal");
-          break;
-      }
-
-      if ((tile_params->mapoptions & 3) == 2)
-        name_suffix = g_strconcat(tile_type, ".night", NULL);
-      else
-      {
-        name_suffix = g_strconcat(tile_type, ".day", NULL);
-        tile_params->mapoptions |= 1;
-      }
-
-      g_free(tile_type);
-      /*
-        TODO:
-        In the original code the pixmap was without alpha channel, which was not
-        working for some tiles (0400000900000505.png for example). I choose the
-        easiest way and enabled the alpha channel on the temp pixbuf, which is
-        not the best solution.The correct one is to strip the alpha channel
-        before saving the tile.
-       */
-      tmp_pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, wtmp, htmp);
-      pixbuf = gdk_pixbuf_new_subpixbuf(tmp_pixbuf,
-                                        pixleft,
-                                        pixtop,
-                                        tile_params->width,
-                                        tile_params->height);
-
-      for (xi = - xia, xoff = 0; xoff < wtmp; xi ++, xoff += tilesize)
-      {
-        if (!pixbuf)
-          break;
-
-        for (yi = - yia, yoff = 0; yoff < htmp; yi ++, yoff += tilesize)
-        {
-          time_t timer;
-          struct stat st;
-          GdkPixbuf *tile_pixbuf;
-          int namex = x + xi;
-          int namey = y + yi;
-          gchar *tile_fname =
-              g_strdup_printf("%s/%02d%06d%06d%02d.png",
-                              priv->cache_dir,
-                              tile_params->zoom,
-                              namex,
-                              namey,
-                              tile_params->mapoptions);
-          gchar *url =
-              g_strdup_printf(
-                "%s/%s/%d/%d/%d/%d/%s?token=%s",
-                "http://maptile.maps.svc.ovi.com/maptiler/maptile/newest",
-                name_suffix,
-                tile_params->zoom,
-                namex,
-                namey,
-                256,
-                "png8",
-                "9b87b24dffafdfcb6dfc66eeba834caa");
-
-          time(&timer);
-
-          if (!stat(tile_fname, &st) &&
-               (st.st_mtim.tv_sec > timer - 30 * 24 * 60 * 60))
-          {
-            tile_pixbuf = gdk_pixbuf_new_from_file(tile_fname, NULL);
-
-            if (!tile_pixbuf)
-            {
-              g_warning("Cached tile corrupted,reloading from server\n");
-              tile_pixbuf = download_tile(priv, url);
-              save_tile_to_cache(priv, tile_pixbuf, tile_fname);
-            }
-            else
-              add_tile_to_list(priv, tile_fname);
-          }
-          else
-          {
-            tile_pixbuf = download_tile(priv, url);
-            save_tile_to_cache(priv, tile_pixbuf, tile_fname);
-          }
-
-          if (tile_pixbuf)
-          {
-            gdk_pixbuf_scale(tile_pixbuf, tmp_pixbuf, xoff, yoff, tilesize,
-                             tilesize, xoff, yoff, 1.0, 1.0,
-                             GDK_INTERP_NEAREST);
-            g_object_unref(tile_pixbuf);
-            tile_pixbuf = NULL;
-          }
-          else
-          {
-            g_warning("Could not get map tile");
-            g_object_unref(pixbuf);
-            pixbuf = 0;
-          }
-
-          g_free(tile_fname);
-          g_free(url);
-          if (!pixbuf)
-            break;
-        }
-      }
-
-      g_free(name_suffix);
-      g_object_unref(tmp_pixbuf);
-
-      message = dbus_message_new_signal(thread_data->responce,
-                                        "com.nokia.Navigation.MapProvider",
-                                        "GetMapTileReply");
-      if (message)
-      {
-        dbus_message_iter_init_append(message, &array);
-
-        if(pixbuf)
-        {
-          double nwlat = y2lat(y - yia, size);
-          double nwlong = x2long(x - xia, size);
-          double selat = y2lat(y + yia, size);
-          double selong = x2long(x + xia, size);
-          DBusMessageIter elem;
-          GdkPixdata pixdata;
-          guint8 *pixdata_buffer;
-          guint len;
-
-          gdk_pixdata_from_pixbuf(&pixdata, pixbuf, FALSE);
-          pixdata_buffer = gdk_pixdata_serialize(&pixdata, &len);
-
-          dbus_message_iter_open_container(&array, DBUS_TYPE_ARRAY,
-                                           DBUS_TYPE_BYTE_AS_STRING, &elem);
-          dbus_message_iter_append_fixed_array(&elem, DBUS_TYPE_BYTE,
-                                               &pixdata_buffer, len);
-          dbus_message_iter_close_container(&array, &elem);
-
-          dbus_message_iter_open_container(&array,
-                                           DBUS_TYPE_STRUCT, NULL, &elem);
-          dbus_message_iter_append_basic(&elem, DBUS_TYPE_DOUBLE, &nwlat);
-          dbus_message_iter_append_basic(&elem, DBUS_TYPE_DOUBLE, &nwlong);
-          dbus_message_iter_close_container(&array, &elem);
-
-          dbus_message_iter_open_container(&array,
-                                           DBUS_TYPE_STRUCT, NULL, &elem);
-          dbus_message_iter_append_basic(&elem, DBUS_TYPE_DOUBLE, &selat);
-          dbus_message_iter_append_basic(&elem, DBUS_TYPE_DOUBLE, &selong);
-          dbus_message_iter_close_container(&array, &elem);
-
-          dbus_connection_send(priv->dbus, message, NULL);
-
-          dbus_message_unref(message);
-          g_free(pixdata_buffer);
-        }
-        else
-        {
-          dbus_connection_send(priv->dbus, message, NULL);
-          dbus_message_unref(message);
-        }
-      }
-
-      if(pixbuf)
-        g_object_unref(pixbuf);
-
+    case GetMapTile:
+      navigation_get_map_tile_reply(thread_data);
+      break;
+    case LocationsToAddresses:
+      navigation_locations_to_addresses_reply(thread_data, 0);
+      break;
+    case LocationsToAddressesVerbose:
+      navigation_locations_to_addresses_reply(thread_data, 1);
+      break;
+    case GetMapTiles:
+      navigation_get_map_tiles_reply(thread_data);
       break;
-    }
     case GetPOICategories:
     {
       DBusMessageIter array;
@@ -1621,9 +6012,7 @@ static void navigation_thread_func(NMProviderThreadData *thread_data,
       };
       const char **cat = categories;
       DBusMessage *message =
-          dbus_message_new_signal(thread_data->responce,
-                                  "com.nokia.Navigation.MapProvider",
-                                  "GetPOICategoriesReply");
+          navigation_reply_new(thread_data, "GetPOICategoriesReply");
       if (message)
       {
         dbus_message_iter_init_append(message, &array);
@@ -1645,22 +6034,81 @@ static void navigation_thread_func(NMProviderThreadData *thread_data,
     }
   }
 
-  if (g_atomic_int_get(&priv->con_ic_do_not_connect) &&
+done:
+  /* the last worker to go idle re-enables connecting */
+  if (g_atomic_int_dec_and_test(&priv->active_threads) &&
+      g_atomic_int_get(&priv->con_ic_do_not_connect) &&
       !g_thread_pool_unprocessed(priv->thread_pool))
     g_atomic_int_set(&priv->con_ic_do_not_connect, FALSE);
 
-  g_free(thread_data->data);
+  G_LOCK(requests);
+  g_hash_table_remove(priv->requests, thread_data->responce);
+  G_UNLOCK(requests);
+
+  if (func == AddressToLocations || func == AddressToLocationsVerbose)
+    geocode_params_free((NMProviderGeocodeParams *)thread_data->data);
+  else
+    g_free(thread_data->data);
+
   g_free(thread_data->responce);
+  g_free(thread_data->sender);
   g_free(thread_data);
 }
 
+static void navigation_request_cancel(gpointer key G_GNUC_UNUSED,
+                                      NMProviderThreadData *thread_data,
+                                      gpointer user_data G_GNUC_UNUSED)
+{
+  g_atomic_int_set(&thread_data->cancelled, TRUE);
+}
+
+/* Waits for the workers to finish, the queued requests are dropped and the
+   ones waiting for a connection are released, as the main loop that would
+   deliver the conic event is not running anymore */
+static void navigation_thread_pools_stop(NMProviderPrivate *priv)
+{
+  G_LOCK(requests);
+  g_hash_table_foreach(priv->requests, (GHFunc)navigation_request_cancel,
+                       NULL);
+  G_UNLOCK(requests);
+
+  g_atomic_int_set(&priv->con_ic_do_not_connect, TRUE);
+  g_mutex_lock(priv->con_ic_mutex);
+  priv->con_ic_stopped = TRUE;
+  priv->con_ic_pending = FALSE;
+  g_cond_broadcast(priv->con_ic_cond);
+  g_mutex_unlock(priv->con_ic_mutex);
+
+  /* the workers wait for the fetch jobs they pushed, so stop them first */
+  g_thread_pool_free(priv->thread_pool, FALSE, TRUE);
+  g_thread_pool_free(priv->fetch_pool, FALSE, TRUE);
+}
+
+static int signal_pipe[2];
+
+static void quit_signal_handler(int signum)
+{
+  char c = signum;
+
+  if (write(signal_pipe[1], &c, 1) < 0)
+    _exit(1);
+}
+
+static gboolean quit_signal_watch(GIOChannel *source G_GNUC_UNUSED,
+                                  GIOCondition condition G_GNUC_UNUSED,
+                                  GMainLoop *loop)
+{
+  g_main_loop_quit(loop);
+
+  return FALSE;
+}
+
 int main()
 {
   NMProvider *provider;
   NMProviderPrivate *priv;
   DBusGConnection *session_gdbus;
   DBusGProxy *proxy;
-  GDir *dir;
   GMainLoop *loop;
   GError *error = NULL;
   guint request_name_result;
@@ -1676,39 +6124,23 @@ int main()
     while (1);
   }
 
-  proxy = dbus_g_proxy_new_for_name(
-            session_gdbus,
-            "org.freedesktop.DBus",
-            "/org/freedesktop/DBus",
-            "org.freedesktop.DBus");
-  if (!dbus_g_proxy_call(
-        proxy, "RequestName", &error,
-        G_TYPE_STRING, "com.nokia.Navigation.NokiaMapsProvider",
-        G_TYPE_UINT, 0,
-        G_TYPE_INVALID,
-        G_TYPE_UINT, &request_name_result,
-        G_TYPE_INVALID))
-  {
-    g_error("Error registering D-Bus service: %s", error->message);
-    /* WHAT ?!? */
-    while (1)
-      ;
-  }
-
-  if (request_name_result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
-  {
-    g_critical("Error registering D-Bus: could not get primary ownership!");
-    return 1;
-  }
-
   provider = (NMProvider *)g_object_new(NM_PROVIDER_TYPE, NULL);
-  g_atomic_int_set(&provider->priv->con_ic_status,
-                   CON_IC_STATUS_DISCONNECTED);
   priv = provider->priv;
+  priv->con_ic_status = CON_IC_STATUS_DISCONNECTED;
+  /* start with a single worker, navigation_thread_pool_adjust() will add more
+     (up to max_threads) when requests start piling up in the queue */
   priv->thread_pool = g_thread_pool_new((GFunc)navigation_thread_func, priv,
                                         1, FALSE, NULL);
+  g_timeout_add_seconds(1, (GSourceFunc)navigation_thread_pool_adjust, priv);
+  /* tiles and other sub-requests are fetched concurrently through that one */
+  priv->fetch_pool = g_thread_pool_new((GFunc)navigation_fetch_job_func, priv,
+                                       priv->max_downloads, FALSE, NULL);
+  g_timeout_add_seconds(HTTP_IDLE_TIMEOUT, http_expire_idle_connections, NULL);
   g_atomic_int_set(&priv->con_ic_do_not_connect, FALSE);
   priv->dbus = dbus_g_connection_get_connection(session_gdbus);
+  dbus_connection_add_filter(priv->dbus,
+                             (DBusHandleMessageFunction)navigation_sender_filter,
+                             priv, NULL);
   priv->cache_dir = g_strdup_printf("%s/MyDocs/.map_tile_cache",
                                     (gchar*)g_get_home_dir());
   if ( !g_file_test(priv->cache_dir,
@@ -1717,44 +6149,43 @@ int main()
     g_warning("Map tile cache directory does not exist and could not create it. Cache directory: %s",
               priv->cache_dir);
 
-  dir = g_dir_open(priv->cache_dir, 0, NULL);
-  if (dir)
-  {
-    for ( ; ; )
-    {
-      const gchar *fname = g_dir_read_name(dir);
-
-      if (!fname)
-        break;
-
-      if (g_strstr_len(fname, -1, ".png"))
-      {
-        struct stat stat_buf;
-        gchar *pngfname = g_strdup_printf("%s/%s", priv->cache_dir, fname);
-        NMProviderCachedTile *tile =
-            (NMProviderCachedTile *)g_malloc(sizeof(NMProviderCachedTile));
-
-        tile->filename = pngfname;
-
-        if (!stat(pngfname, &stat_buf))
-        {
-          tile->timestamp = stat_buf.st_mtim.tv_sec;
-          priv->tile_list = g_slist_insert_sorted(priv->tile_list, tile,
-                                                  (GCompareFunc)compare_tiles);
-        }
-      }
-    }
-
-    g_dir_close(dir);
-  }
-  else
-    g_warning("Could not read files from cache");
+  priv->tile_index = g_hash_table_new((GHashFunc)tile_key_hash,
+                                      (GEqualFunc)tile_key_equal);
+  g_queue_init(&priv->tile_lru);
+  priv->evict_cond = g_cond_new();
+  priv->segments = g_hash_table_new(g_direct_hash, g_direct_equal);
 
+  priv->loc_grid = g_hash_table_new((GHashFunc)tile_key_hash,
+                                    (GEqualFunc)tile_key_equal);
+  priv->loc_heap = g_ptr_array_new();
   priv->loc_hash_table =
       g_hash_table_new_full((GHashFunc)location_hash,
                             (GEqualFunc)location_equal,
                             g_free,
                             (GDestroyNotify)location_destroy_notify);
+  priv->loc_cache_file = g_strdup_printf("%s/.nokiamaps_provider_locations",
+                                         g_get_home_dir());
+  location_cache_load(priv);
+  geocode_cache_load(priv);
+
+  priv->mem_tiles = g_hash_table_new((GHashFunc)tile_key_hash,
+                                     (GEqualFunc)tile_key_equal);
+  g_queue_init(&priv->mem_tiles_lru);
+
+  flight_cond = g_cond_new();
+  priv->requests = g_hash_table_new(g_str_hash, g_str_equal);
+  navigation_flights_init(&priv->tile_flights,
+                          (GHashFunc)tile_key_hash,
+                          (GEqualFunc)tile_key_equal,
+                          sizeof(guint64),
+                          g_object_ref,
+                          g_object_unref);
+  navigation_flights_init(&priv->loc_flights,
+                          (GHashFunc)location_hash,
+                          (GEqualFunc)location_equal,
+                          sizeof(NavigationLocation),
+                          (NMProviderFlightCopyFunc)navigation_address_copy,
+                          (GDestroyNotify)navigation_address_free);
 
   priv->system_gdbus = dbus_g_bus_get(DBUS_BUS_SYSTEM, &error);;
   if (!priv->system_gdbus)
@@ -1765,11 +6196,66 @@ int main()
       ;
   }
 
+  mce_device_mode_init(priv);
+
   priv->response_id = 0;
   dbus_g_connection_register_g_object(session_gdbus, "/Provider",
                                       &provider->parent);
+
+  /* claim the name only once ready to serve, but don't wait for the tile
+     cache index - it is loaded in the background */
+  proxy = dbus_g_proxy_new_for_name(
+            session_gdbus,
+            "org.freedesktop.DBus",
+            "/org/freedesktop/DBus",
+            "org.freedesktop.DBus");
+  if (!dbus_g_proxy_call(
+        proxy, "RequestName", &error,
+        G_TYPE_STRING, "com.nokia.Navigation.NokiaMapsProvider",
+        G_TYPE_UINT, 0,
+        G_TYPE_INVALID,
+        G_TYPE_UINT, &request_name_result,
+        G_TYPE_INVALID))
+  {
+    g_error("Error registering D-Bus service: %s", error->message);
+    /* WHAT ?!? */
+    while (1)
+      ;
+  }
+
+  if (request_name_result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+  {
+    g_critical("Error registering D-Bus: could not get primary ownership!");
+    return 1;
+  }
+
+  g_thread_create((GThreadFunc)tile_index_load_thread, priv, FALSE, NULL);
+  g_thread_create((GThreadFunc)tile_cache_evict_thread, priv, FALSE, NULL);
+  g_timeout_add_seconds(TILE_INDEX_SAVE_INTERVAL,
+                        (GSourceFunc)tile_index_save_timeout, priv);
+  g_timeout_add_seconds(LOCATION_CACHE_SAVE_INTERVAL,
+                        (GSourceFunc)location_cache_save_timeout, priv);
+  g_timeout_add_seconds(GEOCODE_CACHE_SAVE_INTERVAL,
+                        (GSourceFunc)geocode_cache_save_timeout, priv);
+
+  if (pipe(signal_pipe))
+    g_warning("Could not create signal pipe, cache index won't be saved");
+  else
+  {
+    GIOChannel *channel = g_io_channel_unix_new(signal_pipe[0]);
+
+    g_io_add_watch(channel, G_IO_IN, (GIOFunc)quit_signal_watch, loop);
+    g_io_channel_unref(channel);
+    signal(SIGTERM, quit_signal_handler);
+    signal(SIGINT, quit_signal_handler);
+  }
+
   g_main_loop_run(loop);
   g_main_loop_unref(loop);
+  navigation_thread_pools_stop(priv);
+  tile_index_save(priv);
+  location_cache_save(priv);
+  geocode_cache_save(priv);
   g_object_unref(provider);
   g_object_unref(proxy);
 